@@ -1,7 +1,26 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
+#include "../common/spical.h"
+
+#define AK4490_CS	PB4
+#define PGA2311_CS	PB3
+#define SCK			PB2
+#define DOUT		PB1
+#define DIN			PB0		// PGA2311 SDO (SPI calibration read-back)
+
+#define SELECT			PORTB &= ~_BV(AK4490_CS);
+#define DESELECT		PORTB |= _BV(AK4490_CS);
+#define PGA_SELECT		PORTB &= ~_BV(PGA2311_CS);
+#define PGA_DESELECT	PORTB |= _BV(PGA2311_CS);
+
+// 3-wire control port: one 16-bit frame per register, C1 C0 R/W A4..A0
+// then D7..D0, latched at CSN rising. Write only (R/W = 1), no auto
+// increment.
+#define AK4490_CAD		0x00	// C1 C0 = CAD1 CAD0 pins
+#define AK4490_WRITE	0x20
 
 #define CONTROL_1	0x00
 	#define ACKS	7
@@ -78,31 +97,97 @@
 	#define DSDSEL1	0
 
 
+/*
+ * Gain staging: AK4490 digital attenuator + PGA2311 analog volume
+ *
+ * level = attenuation in 0.5dB steps (0: 0dB ... 254: -127dB, 255: mute).
+ * The PGA2311 takes the first 64dB, so the DAC keeps running at full scale and its
+ * noise floor is attenuated together with the signal; below -64dB the AK4490 ATT
+ * takes over. Both devices are written from shadow registers, a register only
+ * when its value changes - no read-back is needed.
+ */
+#define GAIN_MUTE		255
+#define GAIN_DEFAULT	40		// -20dB
+
+static const uint8_t gain_plan[256][2] PROGMEM = {	// {AK4490 ATT, PGA2311 gain}
+	{0xFF,0xC0}, {0xFF,0xBF}, {0xFF,0xBE}, {0xFF,0xBD}, {0xFF,0xBC}, {0xFF,0xBB}, {0xFF,0xBA}, {0xFF,0xB9},
+	{0xFF,0xB8}, {0xFF,0xB7}, {0xFF,0xB6}, {0xFF,0xB5}, {0xFF,0xB4}, {0xFF,0xB3}, {0xFF,0xB2}, {0xFF,0xB1},
+	{0xFF,0xB0}, {0xFF,0xAF}, {0xFF,0xAE}, {0xFF,0xAD}, {0xFF,0xAC}, {0xFF,0xAB}, {0xFF,0xAA}, {0xFF,0xA9},
+	{0xFF,0xA8}, {0xFF,0xA7}, {0xFF,0xA6}, {0xFF,0xA5}, {0xFF,0xA4}, {0xFF,0xA3}, {0xFF,0xA2}, {0xFF,0xA1},
+	{0xFF,0xA0}, {0xFF,0x9F}, {0xFF,0x9E}, {0xFF,0x9D}, {0xFF,0x9C}, {0xFF,0x9B}, {0xFF,0x9A}, {0xFF,0x99},
+	{0xFF,0x98}, {0xFF,0x97}, {0xFF,0x96}, {0xFF,0x95}, {0xFF,0x94}, {0xFF,0x93}, {0xFF,0x92}, {0xFF,0x91},
+	{0xFF,0x90}, {0xFF,0x8F}, {0xFF,0x8E}, {0xFF,0x8D}, {0xFF,0x8C}, {0xFF,0x8B}, {0xFF,0x8A}, {0xFF,0x89},
+	{0xFF,0x88}, {0xFF,0x87}, {0xFF,0x86}, {0xFF,0x85}, {0xFF,0x84}, {0xFF,0x83}, {0xFF,0x82}, {0xFF,0x81},
+	{0xFF,0x80}, {0xFF,0x7F}, {0xFF,0x7E}, {0xFF,0x7D}, {0xFF,0x7C}, {0xFF,0x7B}, {0xFF,0x7A}, {0xFF,0x79},
+	{0xFF,0x78}, {0xFF,0x77}, {0xFF,0x76}, {0xFF,0x75}, {0xFF,0x74}, {0xFF,0x73}, {0xFF,0x72}, {0xFF,0x71},
+	{0xFF,0x70}, {0xFF,0x6F}, {0xFF,0x6E}, {0xFF,0x6D}, {0xFF,0x6C}, {0xFF,0x6B}, {0xFF,0x6A}, {0xFF,0x69},
+	{0xFF,0x68}, {0xFF,0x67}, {0xFF,0x66}, {0xFF,0x65}, {0xFF,0x64}, {0xFF,0x63}, {0xFF,0x62}, {0xFF,0x61},
+	{0xFF,0x60}, {0xFF,0x5F}, {0xFF,0x5E}, {0xFF,0x5D}, {0xFF,0x5C}, {0xFF,0x5B}, {0xFF,0x5A}, {0xFF,0x59},
+	{0xFF,0x58}, {0xFF,0x57}, {0xFF,0x56}, {0xFF,0x55}, {0xFF,0x54}, {0xFF,0x53}, {0xFF,0x52}, {0xFF,0x51},
+	{0xFF,0x50}, {0xFF,0x4F}, {0xFF,0x4E}, {0xFF,0x4D}, {0xFF,0x4C}, {0xFF,0x4B}, {0xFF,0x4A}, {0xFF,0x49},
+	{0xFF,0x48}, {0xFF,0x47}, {0xFF,0x46}, {0xFF,0x45}, {0xFF,0x44}, {0xFF,0x43}, {0xFF,0x42}, {0xFF,0x41},
+	{0xFF,0x40}, {0xFE,0x40}, {0xFD,0x40}, {0xFC,0x40}, {0xFB,0x40}, {0xFA,0x40}, {0xF9,0x40}, {0xF8,0x40},
+	{0xF7,0x40}, {0xF6,0x40}, {0xF5,0x40}, {0xF4,0x40}, {0xF3,0x40}, {0xF2,0x40}, {0xF1,0x40}, {0xF0,0x40},
+	{0xEF,0x40}, {0xEE,0x40}, {0xED,0x40}, {0xEC,0x40}, {0xEB,0x40}, {0xEA,0x40}, {0xE9,0x40}, {0xE8,0x40},
+	{0xE7,0x40}, {0xE6,0x40}, {0xE5,0x40}, {0xE4,0x40}, {0xE3,0x40}, {0xE2,0x40}, {0xE1,0x40}, {0xE0,0x40},
+	{0xDF,0x40}, {0xDE,0x40}, {0xDD,0x40}, {0xDC,0x40}, {0xDB,0x40}, {0xDA,0x40}, {0xD9,0x40}, {0xD8,0x40},
+	{0xD7,0x40}, {0xD6,0x40}, {0xD5,0x40}, {0xD4,0x40}, {0xD3,0x40}, {0xD2,0x40}, {0xD1,0x40}, {0xD0,0x40},
+	{0xCF,0x40}, {0xCE,0x40}, {0xCD,0x40}, {0xCC,0x40}, {0xCB,0x40}, {0xCA,0x40}, {0xC9,0x40}, {0xC8,0x40},
+	{0xC7,0x40}, {0xC6,0x40}, {0xC5,0x40}, {0xC4,0x40}, {0xC3,0x40}, {0xC2,0x40}, {0xC1,0x40}, {0xC0,0x40},
+	{0xBF,0x40}, {0xBE,0x40}, {0xBD,0x40}, {0xBC,0x40}, {0xBB,0x40}, {0xBA,0x40}, {0xB9,0x40}, {0xB8,0x40},
+	{0xB7,0x40}, {0xB6,0x40}, {0xB5,0x40}, {0xB4,0x40}, {0xB3,0x40}, {0xB2,0x40}, {0xB1,0x40}, {0xB0,0x40},
+	{0xAF,0x40}, {0xAE,0x40}, {0xAD,0x40}, {0xAC,0x40}, {0xAB,0x40}, {0xAA,0x40}, {0xA9,0x40}, {0xA8,0x40},
+	{0xA7,0x40}, {0xA6,0x40}, {0xA5,0x40}, {0xA4,0x40}, {0xA3,0x40}, {0xA2,0x40}, {0xA1,0x40}, {0xA0,0x40},
+	{0x9F,0x40}, {0x9E,0x40}, {0x9D,0x40}, {0x9C,0x40}, {0x9B,0x40}, {0x9A,0x40}, {0x99,0x40}, {0x98,0x40},
+	{0x97,0x40}, {0x96,0x40}, {0x95,0x40}, {0x94,0x40}, {0x93,0x40}, {0x92,0x40}, {0x91,0x40}, {0x90,0x40},
+	{0x8F,0x40}, {0x8E,0x40}, {0x8D,0x40}, {0x8C,0x40}, {0x8B,0x40}, {0x8A,0x40}, {0x89,0x40}, {0x88,0x40},
+	{0x87,0x40}, {0x86,0x40}, {0x85,0x40}, {0x84,0x40}, {0x83,0x40}, {0x82,0x40}, {0x81,0x40}, {0x00,0x00},
+};
+
+static uint8_t ak4490_shadow[CONTROL_8 + 1] = {
+	[Lch_ATT] = 0xff, [Rch_ATT] = 0xff		// Reset: 0dB
+};
+static uint8_t pga2311_shadow = 0x00;		// Power-up: mute
+
+
 
 uint8_t SPISend (uint8_t b);
 void AK4490WriteReg (uint8_t reg, uint8_t value);
-uint8_t AK4490ReadReg (uint8_t reg);
+void AK4490Update (uint8_t reg, uint8_t value);
+void PGA2311Write (uint8_t gain);
+void GainSet (uint8_t level);
+
+// SPI clock calibration. The AK4490 control port cannot be read back, so
+// the bus is calibrated through the PGA2311 on the same SCK/DOUT lines:
+// it echoes the previous 16-bit word on SDO (to DIN). One record for the
+// bus, used for both devices.
+#define EE_SPICAL		((uint8_t *) 0x00)		// { dly, ~dly }
+#define SPICAL_PGA2311	0
 
 
 int main () {
 
-	DDRB = _BV(AK4490_CS) | _BV(SCK) /* SCK */ | _BV(DOUT) /* DO !!! */;
+	DDRB = _BV(AK4490_CS) | _BV(PGA2311_CS) | _BV(SCK) /* SCK */ | _BV(DOUT) /* DO !!! */;
 
 	DESELECT;
+	PGA_DESELECT;
 
 	_delay_ms (5);
 
-	
-	//AK4490WriteReg (AUDIO_SERIAL_PORT_CONTROL, 0b00010100);		// 20-bit, right-justified audio data
-	AK4490WriteReg (AUDIO_SERIAL_PORT_CONTROL, _BV(JUS) | _BV(WLEN0));
+	spical_init (SPICAL_PGA2311, EE_SPICAL);	// before any audio: patterns land in the PGA2311 gain
+	PGA2311Write (pga2311_shadow);
 
-	//AK4490WriteReg (POWER_DOWN_AND_CLOCK_CONTROL, 0b00000010);		// set MCLK rate to 256*fs, clear PDN bit
-	AK4490WriteReg (POWER_DOWN_AND_CLOCK_CONTROL, _BV(CLK0));
+	// Format and filter set up in reset (RSTN = 0), then released
+	AK4490WriteReg (CONTROL_1, _BV(ACKS) | _BV(DIF2) | _BV(DIF1) | _BV(DIF0));	// auto MCLK, 32-bit I2S
+	AK4490WriteReg (CONTROL_2, _BV(SD) | _BV(DEM0));		// short delay filter, normal speed, de-emphasis off
+	AK4490WriteReg (CONTROL_3, 0);						// PCM, stereo
+	AK4490WriteReg (CONTROL_1, ak4490_shadow[CONTROL_1] | _BV(RSTN));
 
-	// AK4490ReadReg (AUDIO_SERIAL_PORT_CONTROL);
+	GainSet (GAIN_DEFAULT);
 
 	cli ();
 	set_sleep_mode (SLEEP_MODE_PWR_DOWN);	
+	sleep_enable ();		// sleep_cpu () alone is a no-op without SE
 	sleep_cpu ();
 
 	// just in case
@@ -118,6 +203,7 @@ uint8_t SPISend (uint8_t b) {
 
 	while (!(USISR & _BV(USIOIF))) {
 		USICR = _BV(USIWM0) | _BV(USICS1) | _BV(USICLK) | _BV(USITC);
+		SPICAL_HALF ();
 	}
 
 	return USIDR;
@@ -127,17 +213,57 @@ uint8_t SPISend (uint8_t b) {
 
 void AK4490WriteReg (uint8_t reg, uint8_t value) {
 	SELECT;
-	SPISend (reg & 0x3f);		// bit7 = 0 (~W), bit6 = 0 (autoinc.step 1)
-	SPISend (0xff);				// dummy byte
+	SPISend (AK4490_CAD << 6 | AK4490_WRITE | (reg & 0x1f));
 	SPISend (value);
 	DESELECT;
+	ak4490_shadow[reg] = value;
 }
 
-uint8_t AK4490ReadReg (uint8_t reg) {
-uint8_t value;
-	SELECT;
-	SPISend ((reg & 0x3f) | 0x80);		// bit7 = 1 (R), bit6 = 0 (autoinc.step 1)
-	SPISend (0xff);						// dummy byte	
-	value = SPISend (0xff);			// read data
-	DESELECT;
-	return (value);
+// Only when the value differs from the shadow
+void AK4490Update (uint8_t reg, uint8_t value) {
+	if (ak4490_shadow[reg] != value) {
+		AK4490WriteReg (reg, value);
+	}
+}
+
+void PGA2311Write (uint8_t gain) {
+	PGA_SELECT;
+	SPISend (gain);				// right
+	SPISend (gain);				// left
+	PGA_DESELECT;
+}
+
+// Two words in, the second one has to echo the first
+static uint8_t spical_test (uint8_t dev) {
+static uint8_t p = 0x5a;
+uint8_t e0, e1;
+	(void) dev;
+
+	PGA_SELECT;
+	SPISend (p);
+	SPISend (~p);
+	PGA_DESELECT;
+
+	PGA_SELECT;
+	e0 = SPISend (p ^ 0x3c);
+	e1 = SPISend (~p ^ 0x3c);
+	PGA_DESELECT;
+
+	e0 = (e0 == p) && (e1 == (uint8_t) ~p);
+	p = ~p + 0x27;
+	return (e0);
+}
+
+void GainSet (uint8_t level) {
+uint8_t att = pgm_read_byte (&gain_plan[level][0]);
+uint8_t pga = pgm_read_byte (&gain_plan[level][1]);
+
+	// both stages in the same call, one frame per changed register
+	AK4490Update (Lch_ATT, att);
+	AK4490Update (Rch_ATT, att);
+
+	if (pga2311_shadow != pga) {
+		PGA2311Write (pga);
+		pga2311_shadow = pga;
+	}
+}
@@ -173,6 +173,7 @@ int main () {
 
 	cli ();
 	set_sleep_mode (SLEEP_MODE_PWR_DOWN);	
+	sleep_enable ();		// sleep_cpu () alone is a no-op without SE
 	sleep_cpu ();
 
 	// just in case
@@ -10,6 +10,10 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
+#include "../common/ringbuf.h"
+#include "../common/clkmgr.h"
 
 #define TRUE 1
 #define FALSE 0
@@ -27,7 +31,33 @@
 #ifdef UCSR0A_U2X0 // {`ĂȂ
  #define MYUBRR FOSC/16/(BAUD/2)-1 // UART({)
 #endif
-volatile char usart_recvData; // USARTŎMf[^
+RINGBUF(usart_rx, char, 16) /* USART receive: SIG_USART_RECV -> main */
+RINGBUF(usart_tx, char, 32) /* USART transmit: main -> SIG_USART_DATA (one producer) */
+volatile uint8_t usart_txidle = TRUE; /* shift register empty (SIG_USART_TRANS) */
+volatile uint16_t usart_rx_bytes = 0;
+volatile uint16_t usart_rx_drops = 0; /* usart_rx full */
+
+/* Fleet testing: '?' is answered with "ID=<unit> RX=<bytes> DROP=<bytes>",
+   anything else is echoed, so a host driving many boards (or simulator
+   instances) can tell them apart and time every round trip. The unit ID
+   is the EEPROM byte at EE_UNIT_ID, UNIT_ID while it is unprogrammed. */
+#define EE_UNIT_ID ((uint8_t *)0x00)
+#ifndef UNIT_ID
+#define UNIT_ID 0
+#endif
+uint8_t unit_id;
+
+/* RXD idle timer: Timer0 (CTC, clk/64) restarts on every RXD edge
+   (PCINT16) and sets rx_quiet once the line has stayed high for one 8N2
+   character time at 8MHz. The clock only drops while rx_quiet is set, so
+   never with a byte in flight. An edge while the clock is low stretches the
+   wait by the same factor, which only errs on the safe side. */
+#define RX_IDLE_TICKS ((FOSC/64) * 11 / BAUD + 1) // 144 ticks = 1.15ms
+#define RX_IDLE_CLK ((1<<CS01)|(1<<CS00)) // clk/64
+volatile uint8_t rx_quiet = FALSE;
+
+/* PB1 change for main to report: 1 high, 2 low (usart_tx has one producer) */
+volatile uint8_t pb1_report = 0;
 
 #define LED_SET() sbi(PORTB, PB0) // Տ̓mFLED
 #define LED_CLR() cbi(PORTB, PB0)
@@ -44,20 +74,77 @@ void usart_init(unsigned int ubrr){
   UBRR0H = (unsigned char)(ubrr>>8); // {[[g8bit
   UBRR0L = (unsigned char)ubrr; // {[[g8bit
   UCSR0A = (0<<U2X0); // 
-  UCSR0B = (1<<RXEN0)|(1<<TXEN0)|(0<<RXCIE0); // MAM荞ݕs
+  UCSR0B = (1<<RXEN0)|(1<<TXEN0)|(1<<RXCIE0)|(1<<TXCIE0); // receive/transmit complete interrupt
   UCSR0C = (0<<UMSEL00)|(3<<UCSZ00)|(1<<USBS0)|(0<<UPM00);
   // t[ݒ 񓯊ʐM 8rbg 1Xgbvrbg peB
 }
 
 
+/* RXD idle timer */
+void rx_idle_init(void){
+  TCCR0A = (1<<WGM01); // CTC
+  OCR0A = RX_IDLE_TICKS - 1;
+  TIMSK0 = (1<<OCIE0A);
+  TCCR0B = RX_IDLE_CLK;
+  sbi(PCICR, PCIE2);
+  PCMSK2 = (1<<PCINT16); // RXD (PD0)
+}
+
+
+/* Baud rate after a clock switch (clkmgr.h), always U2X=1:
+   8MHz UBRR=103, 1MHz UBRR=12 (0.2% error) */
+static void clk_retune(uint8_t from, uint8_t to){
+  unsigned int ubrr = (FOSC >> to) / 8 / BAUD - 1;
+  (void)from;
+  UCSR0A = (1<<U2X0);
+  UBRR0H = (unsigned char)(ubrr>>8);
+  UBRR0L = (unsigned char)ubrr;
+}
+
+
 /* UARTŕ񑗐M */
+void usart_sendChar(char c){
+  clk_fast(); // the transmitter is idle whenever the clock is low
+  if(usart_tx_put(c)){
+    sbi(UCSR0B, UDRIE0); // data register empty interrupt drains usart_tx
+  }
+  /* ring full: dropped */
+}
+
 void usart_sendStr(char *str){
   while(*str != NULL){
-    loop_until_bit_is_set(UCSR0A,UDRE0); // Mf[^WX^󂫂܂őҋ@
-    UDR0 = *str++; // 1MA1i
+    usart_sendChar(*str++);
   }
 }
 
+void usart_sendUint(uint16_t v){
+  char buf[6];
+  uint8_t n = 0;
+  do{
+    buf[n++] = '0' + v % 10;
+    v /= 10;
+  }while(v);
+  while(n){
+    usart_sendChar(buf[--n]);
+  }
+}
+
+/* Reply to '?' */
+void usart_sendStatus(void){
+  uint16_t rx, drops;
+  cli();
+  rx = usart_rx_bytes;
+  drops = usart_rx_drops;
+  sei();
+  usart_sendStr("ID=");
+  usart_sendUint(unit_id);
+  usart_sendStr(" RX=");
+  usart_sendUint(rx);
+  usart_sendStr(" DROP=");
+  usart_sendUint(drops);
+  usart_sendStr("\r\n");
+}
+
 /* sω荞ݐݒ */
 void pinchange_init(void){
   sbi(PCICR, PCIE0); // sω荞0
@@ -72,14 +159,93 @@ void pinchange_init(void){
 
 
 int main(void){
+  unit_id = eeprom_read_byte(EE_UNIT_ID);
+  if(unit_id == 0xff){
+    unit_id = UNIT_ID;
+  }
   port_init(); // PORTݒ
   usart_init(MYUBRR); // USARTݒ
+  rx_idle_init();
   pinchange_init(); // sω荞ݐݒ
+  set_sleep_mode(SLEEP_MODE_IDLE); // USART and pin change keep running
   sei(); // S荞݋
   
   LED_SET(); // NmFLED
     
   for(;;){
+    char c;
+    if(pb1_report){
+      uint8_t r;
+      cli();
+      r = pb1_report;
+      pb1_report = 0;
+      sei();
+      usart_sendStr(r == 1 ? "PB1_HIGH\r\n" : "PB1_LOW\r\n");
+    }
+    if(usart_rx_get(&c)){
+      if(c == '?'){
+        usart_sendStatus();
+      }else{
+        usart_sendChar(c); // echo
+      }
+    }
+    cli();
+    if(rx_quiet && bit_is_clear(PCIFR, PCIF2)
+       && usart_tx_count() == 0 && usart_txidle && usart_rx_count() == 0){
+      clk_idle(); // baud rate only changes with no byte on the line either way
+    }
+    if(usart_rx_count() == 0 && !pb1_report){ // sleep until the next interrupt
+      sleep_enable();
+      sei(); // takes effect after sleep_cpu()
+      sleep_cpu();
+      sleep_disable();
+    }
+    sei();
+  }
+}
+
+
+/** USART receive complete **/
+SIGNAL(SIG_USART_RECV){
+  clk_fast(); // back to full speed before the next start bit
+  usart_rx_bytes++;
+  if(!usart_rx_put(UDR0)){
+    usart_rx_drops++; /* overrun: dropped */
+  }
+}
+
+
+/** RXD edge: a character is on the line **/
+SIGNAL(SIG_PIN_CHANGE2){
+  rx_quiet = FALSE;
+  TCNT0 = 0;
+  TIFR0 = (1<<OCF0A); // a match already pending is stale
+  TCCR0B = RX_IDLE_CLK;
+}
+
+
+/** Timer0 compare A: RXD high for a full character **/
+SIGNAL(SIG_OUTPUT_COMPARE0A){
+  TCCR0B = 0; // stopped until the next RXD edge
+  rx_quiet = TRUE;
+}
+
+
+/** USART transmit complete **/
+SIGNAL(SIG_USART_TRANS){
+  usart_txidle = TRUE;
+}
+
+
+/** USART data register empty **/
+SIGNAL(SIG_USART_DATA){
+  char c;
+  if(usart_tx_get(&c)){
+    usart_txidle = FALSE;
+    UDR0 = c;
+  }
+  else{
+    cbi(UCSR0B, UDRIE0);
   }
 }
 
@@ -88,11 +254,11 @@ int main(void){
 SIGNAL(SIG_PIN_CHANGE0){
   if(bit_is_set(PINB, PB1)){ // PB1オ̎
     LED_SET(); // LED_
-    usart_sendStr("PB1_HIGH\r\n");
+    pb1_report = 1; // main queues the text
   }
   else{
     LED_CLR(); // LED
-    usart_sendStr("PB1_LOW\r\n");
+    pb1_report = 2;
   }
 }
 
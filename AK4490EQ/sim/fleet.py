@@ -0,0 +1,316 @@
+#!/usr/bin/env python3
+"""
+Fleet load test for the AK4490EQ controller firmware (main.c) on simulavr
+
+Every instance is one simulated ATmega168 (pysimulavr, the simulavr Python
+binding) in its own process, so the simulations spread over all cores. The
+USART pins are wired to simulavr's serial models and bridged to a pty; a
+control daemon can open those ptys like real boards, or the bench below
+drives them itself.
+
+    fleet.py build [-o sim.elf]
+        Build main.c for the simulator: clock scaling off
+        (CLK_IDLE_SHIFT=0), simulavr does not model CLKPR. The RXD idle
+        timer still runs, but the clock switch it gates is not exercised
+        here; check that on a board.
+
+    fleet.py serve -n 32 [--elf sim.elf]
+        Start 32 instances, print one pty per line, run until ^C.
+
+    fleet.py bench -n 1,8,32,128 [-r 50] [-j 16] [--elf sim.elf]
+        For each instance count: start the fleet, run -r requests per
+        instance from a pool of -j client threads, report and stop it.
+
+Each instance gets its own unit ID (index % 255) in EEPROM, so every '?'
+reply ("ID=<unit> RX=<bytes> DROP=<bytes>") is checked against the link it
+came from. Requests alternate between '?' and an echo of ECHO_LEN bytes.
+The client threads share one run queue of links: a thread takes whichever
+link is ready next and puts it back after one request, so a slow instance
+never holds a thread while others wait. Per instance count the report gives
+requests, errors, throughput and round trip latency (p50/p95/max).
+
+Latency is wall clock and includes the simulation speed: with more
+instances than cores it grows, which is what the bench is meant to show.
+"""
+
+import argparse
+import os
+import queue
+import select
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import tty
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+MAIN_C = os.path.join(HERE, "..", "main.c")
+
+MCU = "atmega168"
+F_CPU = 8000000
+BAUD = 9600                 # main.c BAUD
+SLICE_NS = 200000           # Simulated time per bridge pass
+ECHO = b"0123456789abcdefghijklmnopqrstuv"
+ECHO_LEN = 8                # < usart_rx (16)
+TIMEOUT = 5.0               # s per request
+
+
+# --- build ---------------------------------------------------------------
+
+def build(out, cc="avr-gcc", cflags=""):
+    cmd = [cc, "-mmcu=" + MCU, "-DF_CPU=%dUL" % F_CPU, "-Os", "-std=gnu99",
+           "-DCLK_IDLE_SHIFT=0"] + cflags.split() + ["-o", out, MAIN_C]
+    subprocess.check_call(cmd)
+    return out
+
+
+# EEPROM byte 0 = unit ID, loaded by simulavr from the .eeprom section
+def with_unit_id(elf, unit, workdir, objcopy="avr-objcopy"):
+    ee = os.path.join(workdir, "ee%d.bin" % unit)
+    out = os.path.join(workdir, "unit%d.elf" % unit)
+    with open(ee, "wb") as f:
+        f.write(bytes([unit]))
+    subprocess.check_call([objcopy, "--remove-section", ".eeprom",
+                           "--add-section", ".eeprom=" + ee,
+                           "--set-section-flags", ".eeprom=alloc,load",
+                           "--change-section-address", ".eeprom=0x810000",
+                           elf, out])
+    return out
+
+
+# --- one simulated board (child process) ---------------------------------
+
+def instance(elf, baud):
+    import pysimulavr
+
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    os.set_blocking(master, False)
+
+    pysimulavr.DumpManager.Instance().SetSingleDeviceApp()
+    sc = pysimulavr.SystemClock.Instance()
+    dev = pysimulavr.AvrFactory.instance().makeDevice(MCU)
+    dev.Load(elf)
+    dev.SetClockFreq(10 ** 9 // F_CPU)      # ns per cycle
+    sc.Add(dev)
+
+    rx = pysimulavr.SerialRxBuffered()      # TXD (PD1) -> host
+    tx = pysimulavr.SerialTxBuffered()      # host -> RXD (PD0)
+    rx.SetBaudRate(baud)
+    tx.SetBaudRate(baud)
+    nets = []
+    for dev_pin, pin in (("D1", rx.GetPin("rx")), ("D0", tx.GetPin("tx"))):
+        net = pysimulavr.Net()
+        net.Add(dev.GetPin(dev_pin))
+        net.Add(pin)
+        nets.append(net)
+    sc.Add(rx)
+    sc.Add(tx)
+
+    print(os.ttyname(slave), flush=True)
+
+    quiet = 0
+    while True:
+        # Idle boards sleep in the firmware too; wait for the host instead
+        # of running empty slices flat out. This only saves host CPU:
+        # simulavr still steps every cycle of a slice, sleeping or not
+        if quiet > 50:
+            select.select([master], [], [], 0.002)
+        try:
+            data = os.read(master, 256)
+        except BlockingIOError:
+            data = b""
+        except OSError:
+            break                           # Host side closed
+        for b in data:
+            tx.Send(b)
+
+        sc.RunTimeRange(SLICE_NS)
+
+        out = bytes(rx.Get() & 0xff for _ in range(rx.Size()))
+        if out:
+            os.write(master, out)
+        quiet = 0 if (data or out) else quiet + 1
+
+
+# --- host side -----------------------------------------------------------
+
+class Link:
+    def __init__(self, unit, path):
+        self.unit = unit
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd)
+        self.left = 0
+        self.n = 0
+
+    def read_until(self, done, deadline):
+        buf = b""
+        while not done(buf):
+            t = deadline - time.monotonic()
+            if t <= 0 or not select.select([self.fd], [], [], t)[0]:
+                return None
+            buf += os.read(self.fd, 256)
+        return buf
+
+    def status(self):
+        os.write(self.fd, b"?")
+        r = self.read_until(lambda b: b.endswith(b"\r\n"), time.monotonic() + TIMEOUT)
+        if r is None:
+            return False
+        fields = dict(f.split(b"=", 1) for f in r.split() if b"=" in f)
+        return fields.get(b"ID") == str(self.unit).encode()
+
+    def echo(self):
+        p = ECHO[self.n % (len(ECHO) - ECHO_LEN):][:ECHO_LEN]
+        os.write(self.fd, p)
+        r = self.read_until(lambda b: len(b) >= len(p), time.monotonic() + TIMEOUT)
+        return r == p
+
+    def request(self):
+        self.n += 1
+        return self.status() if self.n & 1 else self.echo()
+
+    def close(self):
+        os.close(self.fd)
+
+
+class Fleet:
+    def __init__(self, elf, n, baud, workdir):
+        self.procs = []
+        self.links = []
+        for i in range(n):
+            unit = i % 255                   # 0xff reads as unprogrammed
+            p = subprocess.Popen([sys.executable, os.path.abspath(__file__),
+                                  "instance", with_unit_id(elf, unit, workdir),
+                                  "--baud", str(baud)],
+                                 stdout=subprocess.PIPE, text=True)
+            self.procs.append(p)
+            self.links.append(Link(unit, p.stdout.readline().strip()))
+
+    def close(self):
+        for link in self.links:
+            link.close()
+        for p in self.procs:
+            p.terminate()
+        for p in self.procs:
+            p.wait()
+
+
+def run(links, requests, jobs):
+    ready = queue.Queue()
+    lat = []
+    errors = [0]
+    lock = threading.Lock()
+
+    for link in links:
+        link.left = requests
+        ready.put(link)
+    remaining = [len(links)]
+
+    def worker():
+        while True:
+            link = ready.get()
+            if link is None:
+                return
+            t0 = time.perf_counter()
+            ok = link.request()
+            t = time.perf_counter() - t0
+            link.left -= 1
+            with lock:
+                lat.append(t)
+                if not ok:
+                    errors[0] += 1
+                if link.left == 0:
+                    remaining[0] -= 1
+                    if remaining[0] == 0:
+                        for _ in range(jobs):
+                            ready.put(None)
+            if link.left:
+                ready.put(link)
+
+    threads = [threading.Thread(target=worker) for _ in range(jobs)]
+    t0 = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return lat, errors[0], time.perf_counter() - t0
+
+
+def pct(sorted_lat, p):
+    return sorted_lat[min(len(sorted_lat) - 1, int(len(sorted_lat) * p))]
+
+
+def bench(args):
+    counts = [int(n) for n in args.n.split(",")]
+    with tempfile.TemporaryDirectory() as workdir:
+        elf = args.elf or build(os.path.join(workdir, "sim.elf"), args.cc, args.cflags)
+        print("%6s %8s %6s %9s %9s %9s %9s" %
+              ("N", "requests", "errors", "req/s", "p50 ms", "p95 ms", "max ms"))
+        for n in counts:
+            fleet = Fleet(elf, n, args.baud, workdir)
+            try:
+                for link in fleet.links:     # Boot: first reply
+                    link.status()
+                lat, errors, wall = run(fleet.links, args.r, min(args.j, n))
+            finally:
+                fleet.close()
+            lat.sort()
+            print("%6d %8d %6d %9.1f %9.1f %9.1f %9.1f" %
+                  (n, len(lat), errors, len(lat) / wall,
+                   pct(lat, 0.50) * 1e3, pct(lat, 0.95) * 1e3, lat[-1] * 1e3),
+                  flush=True)
+
+
+def serve(args):
+    with tempfile.TemporaryDirectory() as workdir:
+        elf = args.elf or build(os.path.join(workdir, "sim.elf"), args.cc, args.cflags)
+        fleet = Fleet(elf, int(args.n), args.baud, workdir)
+        for link in fleet.links:
+            print("%d %s" % (link.unit, os.ttyname(link.fd)), flush=True)
+        try:
+            while True:
+                time.sleep(1)
+        except KeyboardInterrupt:
+            pass
+        finally:
+            fleet.close()
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0].strip())
+    sub = ap.add_subparsers(dest="cmd", required=True)
+
+    b = sub.add_parser("build")
+    b.add_argument("-o", default="sim.elf")
+
+    for name in ("serve", "bench"):
+        s = sub.add_parser(name)
+        s.add_argument("-n", required=True, help="instance count(s), comma separated for bench")
+        s.add_argument("-r", type=int, default=50, help="requests per instance")
+        s.add_argument("-j", type=int, default=os.cpu_count() or 4, help="client threads")
+        s.add_argument("--elf", help="prebuilt image (default: build main.c)")
+        s.add_argument("--baud", type=int, default=BAUD)
+
+    i = sub.add_parser("instance")
+    i.add_argument("elf")
+    i.add_argument("--baud", type=int, default=BAUD)
+
+    for s in sub.choices.values():
+        s.add_argument("--cc", default="avr-gcc")
+        s.add_argument("--cflags", default="", help="extra compiler flags")
+
+    args = ap.parse_args()
+    if args.cmd == "build":
+        build(args.o, args.cc, args.cflags)
+    elif args.cmd == "instance":
+        instance(args.elf, args.baud)
+    elif args.cmd == "serve":
+        serve(args)
+    else:
+        bench(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,234 @@
+#ifndef DIT4192_CHSTAT_H
+#define DIT4192_CHSTAT_H
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+// AES3 / IEC 60958 channel status block builder
+//
+// Bytes are kept in DIT4192 buffer order: channel status bit 0 of each
+// byte is the register MSB, so CS_BIT(n) is the mask of bit n. Byte 23
+// (CRCC, professional mode) is CRC-8, x^8 + x^4 + x^3 + x^2 + 1, preset
+// 1, over bytes 0..22 in transmission order - which in this bit order is
+// the plain MSB-first CRC, one table lookup per byte.
+//
+// The CRC state in front of every byte is kept, so ChStatCRC() only runs
+// from the first byte changed since the last call.
+
+#define CS_BIT(n)		(0x80 >> (n))
+
+#define CS_BYTES		24
+#define CS_CRCC			23
+
+// Byte 0 (professional)
+#define CS0_PRO			CS_BIT(0)
+#define CS0_NONAUDIO	CS_BIT(1)
+#define CS0_EMPH_MASK	(CS_BIT(2) | CS_BIT(3) | CS_BIT(4))
+	#define CS0_EMPH_NA		0								// not indicated
+	#define CS0_EMPH_NONE	CS_BIT(2)						// 100
+	#define CS0_EMPH_5015	(CS_BIT(2) | CS_BIT(3))			// 110
+	#define CS0_EMPH_J17	(CS_BIT(2) | CS_BIT(3) | CS_BIT(4))	// 111
+#define CS0_UNLOCKED	CS_BIT(5)
+#define CS0_FS_MASK		(CS_BIT(6) | CS_BIT(7))
+	#define CS0_FS_NA		0								// see byte 4
+	#define CS0_FS_48K		CS_BIT(7)						// 01
+	#define CS0_FS_44K1		CS_BIT(6)						// 10
+	#define CS0_FS_32K		(CS_BIT(6) | CS_BIT(7))			// 11
+
+// Byte 1
+#define CS1_MODE_MASK	(CS_BIT(0) | CS_BIT(1) | CS_BIT(2) | CS_BIT(3))
+	#define CS1_MODE_2CH	CS_BIT(3)						// 0001
+	#define CS1_MODE_MONO	CS_BIT(2)						// 0010
+
+// Byte 2
+#define CS2_AUX_MASK	(CS_BIT(0) | CS_BIT(1) | CS_BIT(2))
+	#define CS2_AUX_20BIT	0								// 000
+	#define CS2_AUX_24BIT	CS_BIT(2)						// 001
+
+// Byte 4: sampling frequency not covered by byte 0
+#define CS4_FS_MASK		(CS_BIT(3) | CS_BIT(4) | CS_BIT(5) | CS_BIT(6))
+	#define CS4_FS_96K		CS_BIT(5)						// 0010
+	#define CS4_FS_192K		(CS_BIT(5) | CS_BIT(6))			// 0011
+	#define CS4_FS_88K2		(CS_BIT(3) | CS_BIT(5))			// 1010
+	#define CS4_FS_176K4	(CS_BIT(3) | CS_BIT(5) | CS_BIT(6))	// 1011
+
+// Consumer (PRO = 0)
+#define CS0_C_NONAUDIO	CS_BIT(1)
+#define CS0_C_COPY_OK	CS_BIT(2)						// Cp: 1 = copyright not asserted
+#define CS0_C_EMPH_5015	CS_BIT(3)						// 100
+#define CS1_C_CAT_GENERAL	0							// 0000000
+#define CS1_C_CAT_CD	CS_BIT(0)						// 1000000
+#define CS1_C_CAT_DAT	(CS_BIT(0) | CS_BIT(1))			// 1100000
+#define CS1_C_LBIT		CS_BIT(7)
+#define CS3_C_FS_MASK	(CS_BIT(0) | CS_BIT(1) | CS_BIT(2) | CS_BIT(3))
+	#define CS3_C_FS_44K1	0							// 0000
+	#define CS3_C_FS_NA		CS_BIT(0)					// 1000
+	#define CS3_C_FS_48K	CS_BIT(1)					// 0100
+	#define CS3_C_FS_32K	(CS_BIT(0) | CS_BIT(1))		// 1100
+
+// Sampling frequencies for ChStatPro() / ChStatConsumer()
+enum {
+	CS_FS_32K,
+	CS_FS_44K1,
+	CS_FS_48K,
+	CS_FS_88K2,
+	CS_FS_96K,
+	CS_FS_176K4,
+	CS_FS_192K,
+	CS_FS_NA
+};
+
+typedef struct {
+	uint8_t b[CS_BYTES];
+	uint8_t crc_at[CS_BYTES];	// CRC state in front of b[n]
+	uint8_t dirty;				// First byte changed since the last ChStatCRC()
+} chstat_t;
+
+
+static const uint8_t chstat_crc8[256] PROGMEM = {
+	0x00, 0x1d, 0x3a, 0x27, 0x74, 0x69, 0x4e, 0x53,
+	0xe8, 0xf5, 0xd2, 0xcf, 0x9c, 0x81, 0xa6, 0xbb,
+	0xcd, 0xd0, 0xf7, 0xea, 0xb9, 0xa4, 0x83, 0x9e,
+	0x25, 0x38, 0x1f, 0x02, 0x51, 0x4c, 0x6b, 0x76,
+	0x87, 0x9a, 0xbd, 0xa0, 0xf3, 0xee, 0xc9, 0xd4,
+	0x6f, 0x72, 0x55, 0x48, 0x1b, 0x06, 0x21, 0x3c,
+	0x4a, 0x57, 0x70, 0x6d, 0x3e, 0x23, 0x04, 0x19,
+	0xa2, 0xbf, 0x98, 0x85, 0xd6, 0xcb, 0xec, 0xf1,
+	0x13, 0x0e, 0x29, 0x34, 0x67, 0x7a, 0x5d, 0x40,
+	0xfb, 0xe6, 0xc1, 0xdc, 0x8f, 0x92, 0xb5, 0xa8,
+	0xde, 0xc3, 0xe4, 0xf9, 0xaa, 0xb7, 0x90, 0x8d,
+	0x36, 0x2b, 0x0c, 0x11, 0x42, 0x5f, 0x78, 0x65,
+	0x94, 0x89, 0xae, 0xb3, 0xe0, 0xfd, 0xda, 0xc7,
+	0x7c, 0x61, 0x46, 0x5b, 0x08, 0x15, 0x32, 0x2f,
+	0x59, 0x44, 0x63, 0x7e, 0x2d, 0x30, 0x17, 0x0a,
+	0xb1, 0xac, 0x8b, 0x96, 0xc5, 0xd8, 0xff, 0xe2,
+	0x26, 0x3b, 0x1c, 0x01, 0x52, 0x4f, 0x68, 0x75,
+	0xce, 0xd3, 0xf4, 0xe9, 0xba, 0xa7, 0x80, 0x9d,
+	0xeb, 0xf6, 0xd1, 0xcc, 0x9f, 0x82, 0xa5, 0xb8,
+	0x03, 0x1e, 0x39, 0x24, 0x77, 0x6a, 0x4d, 0x50,
+	0xa1, 0xbc, 0x9b, 0x86, 0xd5, 0xc8, 0xef, 0xf2,
+	0x49, 0x54, 0x73, 0x6e, 0x3d, 0x20, 0x07, 0x1a,
+	0x6c, 0x71, 0x56, 0x4b, 0x18, 0x05, 0x22, 0x3f,
+	0x84, 0x99, 0xbe, 0xa3, 0xf0, 0xed, 0xca, 0xd7,
+	0x35, 0x28, 0x0f, 0x12, 0x41, 0x5c, 0x7b, 0x66,
+	0xdd, 0xc0, 0xe7, 0xfa, 0xa9, 0xb4, 0x93, 0x8e,
+	0xf8, 0xe5, 0xc2, 0xdf, 0x8c, 0x91, 0xb6, 0xab,
+	0x10, 0x0d, 0x2a, 0x37, 0x64, 0x79, 0x5e, 0x43,
+	0xb2, 0xaf, 0x88, 0x95, 0xc6, 0xdb, 0xfc, 0xe1,
+	0x5a, 0x47, 0x60, 0x7d, 0x2e, 0x33, 0x14, 0x09,
+	0x7f, 0x62, 0x45, 0x58, 0x0b, 0x16, 0x31, 0x2c,
+	0x97, 0x8a, 0xad, 0xb0, 0xe3, 0xfe, 0xd9, 0xc4
+};
+
+
+static inline void ChStatClear (chstat_t *cs) {
+uint8_t i;
+	for (i = 0; i < CS_BYTES; i++) {
+		cs->b[i] = 0;
+	}
+	cs->crc_at[0] = 0xff;
+	cs->dirty = 0;
+}
+
+static inline void ChStatSet (chstat_t *cs, uint8_t n, uint8_t mask, uint8_t value) {
+uint8_t v = (cs->b[n] & ~mask) | (value & mask);
+	if (v != cs->b[n]) {
+		cs->b[n] = v;
+		if (n < cs->dirty) {
+			cs->dirty = n;
+		}
+	}
+}
+
+// Bring byte 23 up to date; returns 1 when the block changed
+static inline uint8_t ChStatCRC (chstat_t *cs) {
+uint8_t n = cs->dirty;
+uint8_t crc;
+	if (n >= CS_CRCC) {
+		return (0);
+	}
+	if (!(cs->b[0] & CS0_PRO)) {
+		cs->b[CS_CRCC] = 0;
+		cs->dirty = CS_CRCC;
+		return (1);
+	}
+	crc = cs->crc_at[n];
+	for (; n < CS_CRCC; n++) {
+		crc = pgm_read_byte (&chstat_crc8[crc ^ cs->b[n]]);
+		cs->crc_at[n + 1] = crc;
+	}
+	cs->b[CS_CRCC] = crc;
+	cs->dirty = CS_CRCC;
+	return (1);
+}
+
+// Professional profile: PCM audio, two channel, 24-bit main audio
+static inline void ChStatPro (chstat_t *cs, uint8_t fs, uint8_t emph) {
+uint8_t b0, b4 = 0;
+	switch (fs) {
+	case CS_FS_32K:		b0 = CS0_FS_32K;	break;
+	case CS_FS_44K1:	b0 = CS0_FS_44K1;	break;
+	case CS_FS_88K2:	b0 = CS0_FS_NA;		b4 = CS4_FS_88K2;	break;
+	case CS_FS_96K:		b0 = CS0_FS_NA;		b4 = CS4_FS_96K;	break;
+	case CS_FS_176K4:	b0 = CS0_FS_NA;		b4 = CS4_FS_176K4;	break;
+	case CS_FS_192K:	b0 = CS0_FS_NA;		b4 = CS4_FS_192K;	break;
+	case CS_FS_NA:		b0 = CS0_FS_NA;		break;
+	default:			b0 = CS0_FS_48K;	break;
+	}
+
+	ChStatSet (cs, 0, 0xff, CS0_PRO | (emph & CS0_EMPH_MASK) | b0);
+	ChStatSet (cs, 1, CS1_MODE_MASK, CS1_MODE_2CH);
+	ChStatSet (cs, 2, CS2_AUX_MASK, CS2_AUX_24BIT);
+	ChStatSet (cs, 4, CS4_FS_MASK, b4);
+}
+
+// Consumer profile: PCM audio, original category code `cat` (CS1_C_xxx),
+// no emphasis. Consumer blocks carry no CRCC, byte 23 is left at 0.
+static inline void ChStatConsumer (chstat_t *cs, uint8_t fs, uint8_t copy_ok, uint8_t cat) {
+uint8_t b3;
+	switch (fs) {
+	case CS_FS_32K:		b3 = CS3_C_FS_32K;	break;
+	case CS_FS_44K1:	b3 = CS3_C_FS_44K1;	break;
+	case CS_FS_48K:		b3 = CS3_C_FS_48K;	break;
+	default:			b3 = CS3_C_FS_NA;	break;
+	}
+
+	ChStatSet (cs, 0, 0xff, copy_ok ? CS0_C_COPY_OK : 0);
+	ChStatSet (cs, 1, 0xff, cat);
+	ChStatSet (cs, 3, CS3_C_FS_MASK, b3);
+}
+
+
+// Channel status user buffer: A0, B0, A1, B1 ... A23 (0x36), B23 (0x37)
+#define CS_BUF_REG		0x08
+
+// Bytes where b differs from sent, first in *lo and last in *hi; returns 0
+// when the blocks are the same
+static inline uint8_t ChStatDiff (const uint8_t *b, const uint8_t *sent, uint8_t *lo, uint8_t *hi) {
+uint8_t n;
+	for (n = 0; n < CS_BYTES && b[n] == sent[n]; n++);
+	if (n == CS_BYTES) {
+		return (0);
+	}
+	*lo = n;
+	for (n = CS_BYTES - 1; b[n] == sent[n]; n--);
+	*hi = n;
+	return (1);
+}
+
+// b[lo..hi] to the A and B user buffers in one auto-increment burst, and
+// into sent[]. Chip select is the caller's; the bytes go through the
+// application's SPISend ().
+uint8_t SPISend (uint8_t b);
+
+static inline void ChStatBurst (const uint8_t *b, uint8_t *sent, uint8_t lo, uint8_t hi) {
+	SPISend (CS_BUF_REG + lo * 2);	// bit7 = 0 (~W), bit6 = 0 (autoinc.step 1)
+	SPISend (0xff);					// dummy byte
+	for (; lo <= hi; lo++) {
+		SPISend (b[lo]);			// A
+		SPISend (b[lo]);			// B
+		sent[lo] = b[lo];
+	}
+}
+
+#endif
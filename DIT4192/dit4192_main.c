@@ -2,13 +2,36 @@
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
 #include <util/delay.h>
-
-#define DIT4192	PB4
+#include <util/atomic.h>
+#include "../common/ringbuf.h"
+#include "../common/pt.h"
+#include "../common/spical.h"
+#include "dit4192_chstat.h"
+
+#define DIT4192	PB4			// Unit 0 CS (reference unit: INT, block timing)
+#define DIT4192_1		PB3		// Unit 1 CS
+#define DIT4192_2		PB5		// Unit 2 CS
 #define SCK				PB2
 #define DOUT			PB1
-
-#define SELECT			PORTB &= ~_BV(DIT4192);
-#define DESELECT		PORTB |= _BV(DIT4192);
+#define DIT_INT			PB6		// INT0, DIT4192 INT (open drain, active low)
+
+#define U_OUT			PA0		// DIT4192 U (pin 27)
+#define SYNC_IN			PA3		// DIT4192 SYNC (pin 12), PCINT3
+#define LRCK_ICP		PA4		// SYNC again, to ICP0 (Timer0 input capture)
+#define FMT_IN			PA2		// Format indicator, 1 = non-PCM payload
+#define MODE_STRAP0		PA5		// Transmitter mode strap, to GND = 1
+#define MODE_STRAP1		PA6
+
+// Several DIT4192s on one control bus, SYNC/SCLK/U shared, SDATA per unit
+// from the TDM source. Writes go to every unit in dit_cs at once (CDOUT
+// stays Hi-Z except when reading), reads always to one unit.
+#ifndef DIT_UNITS
+#define DIT_UNITS		1		// 1..3
+#endif
+#define DIT_CS_ALL		(_BV(DIT4192) | (DIT_UNITS > 1 ? _BV(DIT4192_1) : 0) | (DIT_UNITS > 2 ? _BV(DIT4192_2) : 0))
+
+#define SELECT			PORTB &= ~dit_cs;
+#define DESELECT		PORTB |= DIT_CS_ALL;
 
 // DIT4192 Register Definition
 
@@ -58,19 +81,219 @@
 #define	CHSTATB_CTRL	0x07
 	#define BTD 	0	
 
+#define CHSTAT_BUF		0x08	// A0, B0, A1, B1 ... A23 (0x36), B23 (0x37)
+
 
 
 
 uint8_t SPISend (uint8_t b);
 void DIT4192WriteReg (uint8_t reg, uint8_t value);
 uint8_t DIT4192ReadReg (uint8_t reg);
+uint8_t DIT4192ReadUnit (uint8_t unit, uint8_t reg);
+void DIT4192WriteCS (const uint8_t *b, uint8_t from, uint8_t to);
+void DIT4192SetFormat (uint8_t fs, uint8_t emph);
+void DIT4192UnitCS (uint8_t unit, uint8_t n, uint8_t mask, uint8_t value);
+void DIT4192IntInit (void);
+uint8_t DIT4192Poll (void);
+
+
+static const uint8_t dit_cs_pin[3] = { _BV(DIT4192), _BV(DIT4192_1), _BV(DIT4192_2) };
+static uint8_t dit_cs = DIT_CS_ALL;		// Units addressed by SELECT
+
+// Channel status per unit. Changes common to all units go out as one
+// broadcast burst up to the first byte where the units differ; from there
+// (at the latest the CRCC) each unit gets its own short burst.
+static chstat_t chstat[DIT_UNITS];
+
+volatile uint8_t dit_stat[DIT_UNITS];	// INTRUPT_STAT bits seen, per unit
+static uint8_t dit_poll = 0;			// Next unit for the round-robin status read
+
+void CsSet (uint8_t n, uint8_t mask, uint8_t value);
+void CsFlush (void);
+void CsResend (void);
+
+#define EE_SPICAL		((uint8_t *) 0x00)		// { dly, ~dly } per unit
+
+void SpiCalibrate (void);
+
+
+#include "dit4192_txmode.h"
+
+// Transmitter mode: see dit4192_txmode.h. The mode bits go out in one
+// write of the TRANSMI_CTRL shadow, with MUTE set for a frame on either
+// side so the change never lands mid-sample.
+
+#define TXMODE_FRAME_US	50		// > one frame at 32kHz; spun, shorter than a wake-up
+
+static uint8_t tx_ctrl = 0;		// TRANSMI_CTRL shadow
+static uint8_t tx_mode = TXMODE_STEREO;
+
+void TxCtrlWrite (uint8_t value);
+void TxModeSet (uint8_t mode);
+uint8_t TxModeStrap (void);
+
+
+// Validity (VAL) manager
+//
+// Non-PCM (FMT_IN high, or ValHost (1)) is flagged twice: the non-audio
+// bit in the channel status and VAL in every sub-frame. The channel status
+// block goes first; its UA -> TA transfer (frames 184..191) makes it live
+// from the next block, and at that block start BTI is read back together
+// with the block start status and VAL is written, so both change at the
+// same block boundary.
+
+static uint8_t val_host = 0;		// Non-PCM by host command
+static uint8_t val_cs = 0;			// Non-audio state sent in the channel status
+static uint8_t val_pending = 0;		// Channel status sent, VAL to follow
+volatile uint8_t val_switches = 0;
+
+void ValHost (uint8_t nonpcm);
+void ValProc (void);
+void ValBlock (uint8_t stat);
+
+
+// Power management
+//
+// Timer0 runs free (16-bit, clk/64 = 8us @ 8MHz, overflow every 524ms).
+// Every overflow without a SYNC edge counts towards PWR_SILENCE_MS; then
+// the line driver goes off (TXOFF) and the DIT4192 into power-down (PDN).
+// The first SYNC edge after that is time stamped, the control registers
+// are written back from dit_shadow[] and the channel status block is
+// re-sent after the PDN wait. PwrUp () is a protothread: the 10ms wait
+// is checked on each main loop pass (SYNC edges keep waking it) instead
+// of spun. The time from that edge to TXOFF = 0 is kept in 8us ticks.
+
+#ifndef PWR_SILENCE_MS
+#define PWR_SILENCE_MS	2000
+#endif
+#define PWR_SILENCE_OVF	((PWR_SILENCE_MS + 523) / 524)
+#define PWR_PDN_WAIT	1250		// 10ms in 8us ticks, PDN = 0 to the channel status buffer
+
+static uint8_t dit_shadow[CHSTATB_CTRL + 1];	// Last value written, 0x01..0x07
+
+static volatile uint8_t sync_seen = 0;		// SYNC edge since the last overflow
+static volatile uint8_t pwr_quiet = 0;		// Overflows without SYNC
+static volatile uint8_t pwr_down = 0;
+static volatile uint16_t pwr_wake_t;		// Ticks() at the first SYNC edge in power-down
+static pt_t pt_pwr;
+static uint8_t pwr_up_run = 0;				// PwrUp () started, waiting for PDN
+
+volatile uint16_t pwr_wake_last = 0;		// Wake to transmit, 8us ticks
+volatile uint16_t pwr_wake_max = 0;
+volatile uint8_t pwr_downs = 0;
+
+void PwrProc (void);
+void PwrDown (void);
+PT_THREAD(PwrUp (pt_t *pt));
+uint16_t Ticks (void);
+
+
+// LRCK monitor
+//
+// SYNC is also wired to ICP0, so Timer0 latches the time of every rising
+// edge in hardware. The block start interrupt (TSLIP with BSSL = 1, once
+// per 192 frames) stores the last captured time, extended to 32 bits with
+// the overflow count. The monitor itself does no work per frame (the U
+// stream does, see USTREAM_FS_MAX). The edge read is within a frame of
+// the block start, below the 8us resolution at the high rates. The main loop closes a window at the
+// first snapshot LRCK_WINDOW_MS after the start of the window and gives
+//   lrck_fs      nearest standard rate (CS_FS_*), CS_FS_NA if none is
+//                within 2%
+//   lrck_ppm     offset from that rate; 8us over 1s is 8 ppm resolution,
+//                on top of the MCU crystal
+//   lrck_drift   ppm change from the previous window
+//   lrck_spread  peak to peak deviation of the snapshot intervals in us,
+//                the period jitter/wander the 8us timer can resolve
+// INT0 stays off from a block start until the main loop has read the
+// status, so a slow pass can miss one; a window with an interval over
+// 1.5 times the shortest is dropped and counted in lrck_slips. Events are
+// sticky bits in lrck_events. The channel status is left as set up: the
+// rate is only reported.
+
+#ifndef LRCK_WINDOW_MS
+#define LRCK_WINDOW_MS		1000
+#endif
+#ifndef LRCK_UNSTABLE_US
+#define LRCK_UNSTABLE_US	40		// Spread limit
+#endif
+#define LRCK_SNAP			192		// Frames per snapshot (one block)
+#define LRCK_WINDOW_TICKS	((uint32_t) LRCK_WINDOW_MS * 125)
+
+#define LRCK_EV_RATE		0x01	// lrck_fs changed
+#define LRCK_EV_UNSTABLE	0x02	// lrck_spread above LRCK_UNSTABLE_US
+#define LRCK_EV_SLIP		0x04	// Block start missed, window dropped
+
+static volatile uint16_t lrck_ovf;			// Timer0 overflows, upper 16 time bits
+static volatile uint32_t lrck_snap_t;		// Capture time at the last block start
+static volatile uint8_t lrck_snap_seq;
+
+static uint8_t lrck_run = 0;				// Window open
+static uint8_t lrck_seq;
+static uint32_t lrck_t0, lrck_tp;			// Window start, last snapshot
+static uint32_t lrck_n;						// Frames in the window
+static uint16_t lrck_sub_min, lrck_sub_max;	// Snapshot intervals, ticks
+
+volatile uint8_t lrck_fs = CS_FS_48K;		// As set up in main ()
+volatile int16_t lrck_ppm;
+volatile int16_t lrck_drift;
+volatile uint16_t lrck_spread;
+volatile uint16_t lrck_windows;
+volatile uint16_t lrck_slips;
+volatile uint8_t lrck_events;
+
+void LrckProc (void);
+void LrckWindow (uint32_t dt);
+
+
+// User data (U bit) stream
+//
+// The DIT4192 has no user data buffer: U is an input pin latched with
+// SYNC. One U bit is sent per frame (both subframes carry it, the pin is
+// changed at the SYNC rising edge), MSB first, so a 192 frame block
+// carries 24 bytes. Two blocks are double buffered: at every block start
+// (TSLIP interrupt with BSSL = 1) the filled block goes on the wire and
+// the main loop refills the other one from the ring; if the ring runs
+// short the rest of the block is padded with 0.
+//
+// The pin change interrupt fires on both SYNC edges, about 110 cycles a
+// frame with the falling edge returning at once. At 8MHz a 48kHz frame is
+// 166 cycles, a 96kHz frame 83, so U is only streamed up to
+// USTREAM_FS_MAX. Above it (or at a rate lrck_fs does not know) the pin
+// change is masked, U stays at 0 and the ring keeps its data; the
+// overflow ISR then takes SYNC activity from the input capture flag.
+
+#define USTREAM_BLOCK	24
+#define USTREAM_FS_MAX	CS_FS_48K
+
+RINGBUF(ustream, uint8_t, 64)
+
+static uint8_t ublock[2][USTREAM_BLOCK];
+static volatile uint8_t ublock_tx;			// Block on the wire
+static volatile uint8_t ublock_pos;			// Byte in ublock[ublock_tx]
+static volatile uint8_t ublock_mask;		// Bit in that byte
+static volatile uint8_t ublock_swap;		// Block start seen, refill pending
+static uint8_t ustream_on = 1;				// lrck_fs <= USTREAM_FS_MAX
+
+volatile uint16_t ustream_bytes;			// Bytes sent
+volatile uint16_t ustream_blocks;			// Blocks sent
+volatile uint16_t ustream_underruns;		// Blocks padded (ring ran short)
+
+uint8_t UStreamWrite (const uint8_t *data, uint8_t len);
+uint8_t UStreamFree (void);
+void UStreamFill (void);
+void UStreamRate (uint8_t fs);
+void UBlockStart (void);
 
 
 
 
 int main () {
+uint8_t i;
 
-	DDRB = _BV(DIT4192) | _BV(SCK) /* SCK */ | _BV(DOUT) /* DO !!! */;
+	DDRB = DIT_CS_ALL | _BV(SCK) /* SCK */ | _BV(DOUT) /* DO !!! */;
+	DDRA = _BV(U_OUT);
+	PORTA |= _BV(MODE_STRAP0) | _BV(MODE_STRAP1);
+	PORTB |= _BV(DIT_INT);		// pull-up for the open drain INT
 
 	DESELECT;
 
@@ -83,14 +306,179 @@ int main () {
 	//DIT4192WriteReg (PWRDCLK_CTRL, 0b00000010);		// set MCLK rate to 256*fs, clear PDN bit
 	DIT4192WriteReg (PWRDCLK_CTRL, _BV(CLK0));
 
+	_delay_ms (10);		// PDN = 0 to the first channel status buffer access
+
+	SpiCalibrate ();
+
+	for (i = 0; i < DIT_UNITS; i++) {
+		ChStatClear (&chstat[i]);
+	}
+	DIT4192SetFormat (CS_FS_48K, CS0_EMPH_NONE);
+	TxModeSet (TxModeStrap ());
+
 	// DIT4192ReadReg (AUDSERP_CTRL);
 
-	cli ();
-	set_sleep_mode (SLEEP_MODE_PWR_DOWN);	
-	sleep_cpu ();
+	DIT4192IntInit ();
+
+	MCUCR &= ~(_BV(ISC01) | _BV(ISC00));	// INT0 low level
+	PCMSK0 = _BV(SYNC_IN);
+	PCMSK1 = 0;
+	GIMSK |= _BV(INT0) | _BV(PCIE1);
+
+	// Timer0: 16-bit, clk/64, free running
+	// Input capture on ICP0 (LRCK_ICP), rising edge
+	TCCR0A = _BV(TCW0) | _BV(ICEN0) | _BV(ICES0);
+	TCCR0B = _BV(CS01) | _BV(CS00);
+	TIMSK |= _BV(TOIE0);
+
+	sei ();
+	set_sleep_mode (SLEEP_MODE_IDLE);
+
+	while (1) {
+		PwrProc ();
+		if (!pwr_down) {
+			if (ublock_swap) {
+				ValBlock (DIT4192Poll ());					// clears TSLIP/BTI, releases INT
+				UStreamFill ();
+			}
+			LrckProc ();
+			ValProc ();
+			if (TxModeStrap () != tx_mode) {
+				TxModeSet (TxModeStrap ());
+			}
+		}
+
+		// Sleep until the next interrupt, unless an ISR has handed over
+		// work since it was checked above: block start, the first SYNC
+		// edge in power-down, or the silence limit. Checked with
+		// interrupts off; sei () takes effect after sleep_cpu ().
+		cli ();
+		if (!ublock_swap && !(pwr_down ? sync_seen && !pwr_up_run : pwr_quiet >= PWR_SILENCE_OVF)) {
+			sleep_enable ();
+			sei ();
+			sleep_cpu ();
+			sleep_disable ();
+		}
+		sei ();
+	}
+}
+
 
-	// just in case
-	while (1);
+// Queue user data; returns the number of bytes taken (0 when full)
+uint8_t UStreamWrite (const uint8_t *data, uint8_t len) {
+uint8_t n = 0;
+	while (n < len && ustream_put (data[n])) {
+		n++;
+	}
+	return (n);
+}
+
+uint8_t UStreamFree (void) {
+	return (ustream_free ());
+}
+
+
+// Refill the block that just left the wire, then re-arm INT0
+// (INTRUPT_STAT has been read, INT is released)
+void UStreamFill (void) {
+uint8_t *p = ublock[ublock_tx ^ 1];
+uint8_t i;
+
+	if (!ustream_on) {
+		ublock_swap = 0;
+		GIMSK |= _BV(INT0);
+		return;
+	}
+
+	for (i = 0; i < USTREAM_BLOCK; i++) {
+		if (!ustream_get (&p[i])) {
+			break;
+		}
+	}
+	ustream_bytes += i;
+	if (i < USTREAM_BLOCK) {
+		ustream_underruns++;
+		for (; i < USTREAM_BLOCK; i++) {
+			p[i] = 0;
+		}
+	}
+	ustream_blocks++;
+
+	ublock_swap = 0;
+	GIMSK |= _BV(INT0);
+}
+
+// Stream U only at rates the pin change interrupt keeps up with
+void UStreamRate (uint8_t fs) {
+	ustream_on = (fs <= USTREAM_FS_MAX);
+	if (ustream_on) {
+		PCMSK0 |= _BV(SYNC_IN);
+	} else {
+		PCMSK0 &= ~_BV(SYNC_IN);
+		PORTA &= ~_BV(U_OUT);
+	}
+}
+
+
+// Block start: put the filled block on the wire. INT stays low until
+// the status is read, so INT0 is off until UStreamFill() has done that.
+ISR (INT0_vect) {
+uint8_t l = OCR0A;		// ICR0 low byte first
+uint16_t icr = ((uint16_t) OCR0B << 8) | l;
+uint16_t hi = lrck_ovf;
+
+	GIMSK &= ~_BV(INT0);
+
+	if ((TIFR & _BV(TOV0)) && !(icr & 0x8000)) {
+		hi++;				// Captured after an overflow not yet counted
+	}
+	lrck_snap_t = ((uint32_t) hi << 16) | icr;
+	lrck_snap_seq++;
+
+	UBlockStart ();
+}
+
+// Put the filled block on the wire; INT0 is off until UStreamFill ()
+void UBlockStart (void) {
+	ublock_tx ^= 1;
+	ublock_pos = 0;
+	ublock_mask = 0x80;
+	ublock_swap = 1;
+}
+
+
+// SYNC rising edge: present the next U bit for this frame. The pin
+// change fires on the falling edge too; that one returns first thing.
+ISR (PCINT_vect) {
+uint8_t pos, mask;
+
+	if (!(PINA & _BV(SYNC_IN))) {
+		return;
+	}
+
+	if (pwr_down && !sync_seen) {
+		pwr_wake_t = Ticks ();
+	}
+	sync_seen = 1;
+
+	pos = ublock_pos;
+	mask = ublock_mask;
+	if (pos >= USTREAM_BLOCK) {
+		return;
+	}
+
+	if (ublock[ublock_tx][pos] & mask) {
+		PORTA |= _BV(U_OUT);
+	} else {
+		PORTA &= ~_BV(U_OUT);
+	}
+
+	mask >>= 1;
+	if (!mask) {
+		mask = 0x80;
+		ublock_pos = pos + 1;
+	}
+	ublock_mask = mask;
 }
 
 
@@ -102,6 +490,7 @@ uint8_t SPISend (uint8_t b) {
 
 	while (!(USISR & _BV(USIOIF))) {
 		USICR = _BV(USIWM0) | _BV(USICS1) | _BV(USICLK) | _BV(USITC);
+		SPICAL_HALF ();
 	}
 
 	return USIDR;
@@ -110,6 +499,9 @@ uint8_t SPISend (uint8_t b) {
 
 
 void DIT4192WriteReg (uint8_t reg, uint8_t value) {
+	if (reg <= CHSTATB_CTRL) {
+		dit_shadow[reg] = value;
+	}
 	SELECT;
 	SPISend (reg & 0x3f);		// bit7 = 0 (~W), bit6 = 0 (autoinc.step 1)
 	SPISend (0xff);				// dummy byte
@@ -117,6 +509,432 @@ void DIT4192WriteReg (uint8_t reg, uint8_t value) {
 	DESELECT;
 }
 
+// Professional channel status for a new sample rate / emphasis. Only the
+// bytes that changed are run through the CRC, and the block goes out in
+// one burst, so the next block boundary already carries it.
+void DIT4192SetFormat (uint8_t fs, uint8_t emph) {
+uint8_t i;
+	for (i = 0; i < DIT_UNITS; i++) {
+		ChStatPro (&chstat[i], fs, emph);
+	}
+	CsSet (1, CS1_MODE_MASK, TXMODE_CS1 (tx_mode));
+	CsSet (0, CS0_NONAUDIO, val_cs ? CS0_NONAUDIO : 0);
+	CsFlush ();
+}
+
+// Per-unit channel status byte (e.g. channel numbering); CsFlush() sends it
+void DIT4192UnitCS (uint8_t unit, uint8_t n, uint8_t mask, uint8_t value) {
+	ChStatSet (&chstat[unit], n, mask, value);
+}
+
+void TxCtrlWrite (uint8_t value) {
+	tx_ctrl = value;
+	DIT4192WriteReg (TRANSMI_CTRL, value);
+}
+
+
+void TxModeSet (uint8_t mode) {
+uint8_t muted = tx_ctrl & _BV(MUTE);
+
+	mode &= 0x03;
+	if (!muted) {
+		TxCtrlWrite (tx_ctrl | _BV(MUTE));
+		_delay_us (TXMODE_FRAME_US);
+	}
+	TxCtrlWrite ((tx_ctrl & ~TXMODE_MASK) | txmode_bits[mode]);
+	tx_mode = mode;
+
+	// Channel mode in the channel status follows
+	CsSet (1, CS1_MODE_MASK, TXMODE_CS1 (mode));
+	CsFlush ();
+
+	if (!muted) {
+		_delay_us (TXMODE_FRAME_US);
+		TxCtrlWrite (tx_ctrl & ~_BV(MUTE));
+	}
+}
+
+
+void PwrProc (void) {
+	if (pwr_down) {
+		if (sync_seen) {
+			pwr_up_run = PT_SCHEDULE (PwrUp (&pt_pwr));
+			if (!pwr_up_run) {
+				PT_INIT (&pt_pwr);
+			}
+		}
+	} else if (pwr_quiet >= PWR_SILENCE_OVF) {
+		PwrDown ();
+	}
+}
+
+void PwrDown (void) {
+	DIT4192WriteReg (TRANSMI_CTRL, tx_ctrl | _BV(TXOFF));
+	DIT4192WriteReg (PWRDCLK_CTRL, dit_shadow[PWRDCLK_CTRL] | _BV(PDN));
+
+	GIMSK &= ~_BV(INT0);		// no block starts while powered down
+	ublock_swap = 0;
+	PCMSK0 |= _BV(SYNC_IN);		// the first SYNC edge wakes
+
+	sync_seen = 0;
+	pwr_down = 1;
+	lrck_run = 0;
+	pwr_downs++;
+}
+
+PT_THREAD(PwrUp (pt_t *pt)) {
+static uint16_t t0;
+uint16_t t;
+
+	PT_BEGIN (pt);
+
+	DIT4192WriteReg (PWRDCLK_CTRL, dit_shadow[PWRDCLK_CTRL] & ~_BV(PDN));
+	DIT4192WriteReg (AUDSERP_CTRL, dit_shadow[AUDSERP_CTRL]);
+	DIT4192IntInit ();
+	DIT4192WriteReg (TRANSMI_CTRL, tx_ctrl | _BV(TXOFF));
+
+	t0 = Ticks ();
+	PT_WAIT_UNTIL (pt, (uint16_t) (Ticks () - t0) >= PWR_PDN_WAIT);
+	CsResend ();
+	DIT4192Poll ();
+
+	TxCtrlWrite (tx_ctrl);
+	GIMSK |= _BV(INT0);
+	UStreamRate (lrck_fs);
+
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		t = Ticks () - pwr_wake_t;
+		pwr_quiet = 0;
+		pwr_down = 0;
+	}
+	pwr_wake_last = t;
+	if (t > pwr_wake_max) {
+		pwr_wake_max = t;
+	}
+
+	PT_END (pt);
+}
+
+
+uint16_t Ticks (void) {
+uint8_t l = TCNT0L;		// low byte first, latches TCNT0H
+	return (((uint16_t) TCNT0H << 8) | l);
+}
+
+
+ISR (TIMER0_OVF_vect) {
+	lrck_ovf++;
+	if (pwr_down) {
+		return;			// sync_seen is the wake request now
+	}
+	if (TIFR & _BV(ICF0)) {
+		TIFR = _BV(ICF0);		// SYNC captured, also with the pin change masked
+		sync_seen = 1;
+	}
+	if (sync_seen) {
+		sync_seen = 0;
+		pwr_quiet = 0;
+	} else if (pwr_quiet < 0xff) {
+		pwr_quiet++;
+	}
+}
+
+
+// At each snapshot; a missed one (or a power-down) restarts the window
+void LrckProc (void) {
+uint32_t t;
+uint16_t d;
+uint8_t seq;
+
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		t = lrck_snap_t;
+		seq = lrck_snap_seq;
+	}
+	if (seq == lrck_seq && lrck_run) {
+		return;
+	}
+
+	if (lrck_run && (uint8_t) (seq - lrck_seq) == 1) {
+		d = t - lrck_tp;
+		if (d < lrck_sub_min) {
+			lrck_sub_min = d;
+		}
+		if (d > lrck_sub_max) {
+			lrck_sub_max = d;
+		}
+		lrck_n += LRCK_SNAP;
+		lrck_tp = t;
+		lrck_seq = seq;
+		if (t - lrck_t0 < LRCK_WINDOW_TICKS) {
+			return;
+		}
+		if (lrck_sub_max > lrck_sub_min + lrck_sub_min / 2) {
+			lrck_slips++;			// A block start went by unseen
+			lrck_events |= LRCK_EV_SLIP;
+		} else {
+			LrckWindow (t - lrck_t0);
+		}
+	}
+
+	lrck_run = 1;
+	lrck_seq = seq;
+	lrck_t0 = lrck_tp = t;
+	lrck_n = 0;
+	lrck_sub_min = 0xffff;
+	lrck_sub_max = 0;
+}
+
+// Standard rates in 100Hz, in CS_FS_* order
+static const uint16_t lrck_rates[CS_FS_NA] = { 320, 441, 480, 882, 960, 1764, 1920 };
+
+// fs = n / (dt * 8us). The rates are multiples of 100Hz and 1 / 8us is
+// 1250 * 100Hz, so n * 1250 against rate * dt stays in 32 bits.
+void LrckWindow (uint32_t dt) {
+uint32_t fs100 = lrck_n * 1250 / ((dt + 50) / 100);
+uint8_t i, fs = CS_FS_NA;
+int32_t e;
+int16_t ppm = 0;
+uint16_t spread = (lrck_sub_max - lrck_sub_min) * 8;
+
+	for (i = 0; i < CS_FS_NA; i++) {
+		if ((fs100 > lrck_rates[i] ? fs100 - lrck_rates[i] : lrck_rates[i] - fs100) * 50 < lrck_rates[i]) {
+			fs = i;
+			break;
+		}
+	}
+
+	if (fs != CS_FS_NA) {
+		e = (int32_t) (lrck_n * 1250) - (int32_t) (lrck_rates[fs] * dt);
+		if (e > 2000000) {
+			e = 2000000;
+		} else if (e < -2000000) {
+			e = -2000000;
+		}
+		ppm = e * 1000 / (int32_t) (lrck_rates[fs] * dt / 1000);
+	}
+
+	if (fs != lrck_fs) {
+		lrck_fs = fs;
+		lrck_events |= LRCK_EV_RATE;
+		UStreamRate (fs);
+	} else {
+		lrck_drift = ppm - lrck_ppm;
+	}
+	lrck_ppm = ppm;
+	lrck_spread = spread;
+	lrck_windows++;
+
+	if (spread > LRCK_UNSTABLE_US) {
+		lrck_events |= LRCK_EV_UNSTABLE;
+	}
+}
+
+
+uint8_t TxModeStrap (void) {
+	return ((~PINA >> MODE_STRAP0) & 0x03);
+}
+
+
+void ValHost (uint8_t nonpcm) {
+	val_host = nonpcm;
+}
+
+void ValProc (void) {
+uint8_t want = val_host || (PINA & _BV(FMT_IN));
+
+	if (want == val_cs || val_pending) {
+		return;
+	}
+	val_cs = want;
+	CsSet (0, CS0_NONAUDIO, want ? CS0_NONAUDIO : 0);
+	CsFlush ();
+	val_pending = 1;
+}
+
+// At block start, with the INTRUPT_STAT read there
+void ValBlock (uint8_t stat) {
+	if (val_pending && (stat & _BV(BTI))) {
+		TxCtrlWrite (val_cs ? (tx_ctrl | _BV(VAL)) : (tx_ctrl & ~_BV(VAL)));
+		val_pending = 0;
+		val_switches++;
+	}
+}
+
+
+// Same bytes to channel A and B of the units in dit_cs, one auto-increment
+// burst from CS byte `from` to `to`
+void DIT4192WriteCS (const uint8_t *b, uint8_t from, uint8_t to) {
+	SELECT;
+	SPISend (CHSTAT_BUF + from * 2);	// bit7 = 0 (~W), bit6 = 0 (autoinc.step 1)
+	SPISend (0xff);						// dummy byte
+	for (; from <= to; from++) {
+		SPISend (b[from]);				// A
+		SPISend (b[from]);				// B
+	}
+	DESELECT;
+}
+
+
+void CsSet (uint8_t n, uint8_t mask, uint8_t value) {
+uint8_t i;
+	for (i = 0; i < DIT_UNITS; i++) {
+		ChStatSet (&chstat[i], n, mask, value);
+	}
+}
+
+void CsFlush (void) {
+uint8_t from = CS_BYTES;
+uint8_t split, i, u, stat;
+
+	for (u = 0; u < DIT_UNITS; u++) {
+		if (chstat[u].dirty < from) {
+			from = chstat[u].dirty;
+		}
+		ChStatCRC (&chstat[u]);
+	}
+	if (from >= CS_CRCC) {
+		return;			// Clean: ChStatCRC () leaves dirty at CS_CRCC
+	}
+
+	// Common part: up to the first byte where any unit differs from unit 0
+	for (split = from; split < CS_BYTES; split++) {
+		for (u = 1; u < DIT_UNITS && chstat[u].b[split] == chstat[0].b[split]; u++);
+		if (u < DIT_UNITS) {
+			break;
+		}
+	}
+
+	DIT4192WriteReg (CHSTATB_CTRL, _BV(BTD));	// hold the UA -> TA transfer (all units)
+
+	// A BTI latched before BTD = 1 belongs to the old block; read it out
+	// now, so the next block start status only shows the transfer of this
+	// one. Other status bits are kept for DIT4192Poll (). The read also
+	// clears TSLIP and releases INT, so a block start INT0 has not taken
+	// yet is started here; it has no capture time, the LRCK window starts
+	// over at the next one.
+	ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+		stat = DIT4192ReadUnit (0, INTRUPT_STAT);
+		if ((stat & _BV(TSLIP)) && (GIMSK & _BV(INT0))) {
+			GIMSK &= ~_BV(INT0);
+			UBlockStart ();
+			lrck_run = 0;
+		}
+	}
+	dit_stat[0] |= stat & ~_BV(BTI);
+	for (u = 1; u < DIT_UNITS; u++) {
+		dit_stat[u] |= DIT4192ReadUnit (u, INTRUPT_STAT) & ~_BV(BTI);
+	}
+
+	if (split > from) {
+		DIT4192WriteCS (chstat[0].b, from, split - 1);
+	}
+	if (split < CS_BYTES) {
+		for (u = 0; u < DIT_UNITS; u++) {
+			dit_cs = dit_cs_pin[u];
+			DIT4192WriteCS (chstat[u].b, split, CS_BYTES - 1);
+		}
+		dit_cs = DIT_CS_ALL;
+	}
+
+	DIT4192WriteReg (CHSTATB_CTRL, 0);			// transfer at frames 184..191
+
+	for (i = 0; i < DIT_UNITS; i++) {
+		dit_stat[i] &= ~_BV(BTI);
+	}
+}
+
+// Whole block again, e.g. after power-down
+void CsResend (void) {
+uint8_t u;
+	for (u = 0; u < DIT_UNITS; u++) {
+		chstat[u].dirty = 0;
+	}
+	CsFlush ();
+}
+
+
+// Block start -> TSLIP interrupt, INT active low (level). Only unit 0
+// drives INT; all units run off the same SYNC and get the same writes.
+void DIT4192IntInit (void) {
+	DIT4192WriteReg (INTRUPT_MODE, _BV(TSLIPM1));
+	DIT4192WriteReg (INTRUPT_MASK, 0);
+	dit_cs = _BV(DIT4192);
+	DIT4192WriteReg (INTRUPT_MASK, _BV(MTSLIP) | _BV(BSSL));
+	dit_cs = DIT_CS_ALL;
+}
+
+// At block start: status of unit 0, plus one other unit in turn, so the
+// bus load per block stays at two reads whatever the unit count
+uint8_t DIT4192Poll (void) {
+uint8_t stat = DIT4192ReadUnit (0, INTRUPT_STAT);
+
+	dit_stat[0] |= stat;
+	if (DIT_UNITS > 1) {
+		if (++dit_poll >= DIT_UNITS) {
+			dit_poll = 1;
+		}
+		dit_stat[dit_poll] |= DIT4192ReadUnit (dit_poll, INTRUPT_STAT);
+	}
+	return (stat);
+}
+
+
+// Every unit is calibrated and keeps its own EEPROM record; the bus runs
+// at the slowest of them since writes are broadcast
+void SpiCalibrate (void) {
+uint8_t u, d, dly = 0;
+	for (u = 0; u < DIT_UNITS; u++) {
+		d = spical_init (u, EE_SPICAL + u * 2);
+		if (d > dly) {
+			dly = d;
+		}
+	}
+	spi_dly = dly;
+}
+
+// Pattern burst through the channel status buffer of one unit and back.
+// BTD stays 1, so none of it is transmitted; the block is written again
+// by the next CsFlush ().
+static uint8_t spical_test (uint8_t dev) {
+static uint8_t seed = 0x5a;
+uint8_t i, ok = 1;
+
+	dit_cs = dit_cs_pin[dev];
+	DIT4192WriteReg (CHSTATB_CTRL, _BV(BTD));
+
+	SELECT;
+	SPISend (CHSTAT_BUF);				// write, autoinc.step 1
+	SPISend (0xff);
+	for (i = 0; i < CS_BYTES * 2; i++) {
+		SPISend (seed ^ (i * 0x3b));
+	}
+	DESELECT;
+
+	SELECT;
+	SPISend (CHSTAT_BUF | 0x80);		// read, autoinc.step 1
+	SPISend (0xff);
+	for (i = 0; i < CS_BYTES * 2; i++) {
+		if (SPISend (0xff) != (uint8_t) (seed ^ (i * 0x3b))) {
+			ok = 0;
+		}
+	}
+	DESELECT;
+
+	dit_cs = DIT_CS_ALL;
+	seed = ~seed + 0x27;
+	return (ok);
+}
+
+
+uint8_t DIT4192ReadUnit (uint8_t unit, uint8_t reg) {
+uint8_t value;
+	dit_cs = dit_cs_pin[unit];
+	value = DIT4192ReadReg (reg);
+	dit_cs = DIT_CS_ALL;
+	return (value);
+}
+
+// dit_cs must address a single unit
 uint8_t DIT4192ReadReg (uint8_t reg) {
 uint8_t value;
 	SELECT;
@@ -0,0 +1,35 @@
+#ifndef DIT4192_TXMODE_H
+#define DIT4192_TXMODE_H
+
+#include <stdint.h>
+#include "dit4192_chstat.h"
+
+// Transmitter mode (strap PA6:PA5, or TxModeSet())
+//
+// TXMODE_STEREO:	A = left, B = right, own channel status each
+// TXMODE_MONO_L:	left only (MONO, MDAT = 0), channel status A for both
+// TXMODE_MONO_R:	right only (MONO, MDAT = 1), channel status B for both
+// TXMODE_SHARED_CS:	stereo audio, channel status A for both sub-frames
+//
+// Needs the TRANSMI_CTRL bit numbers (MONO, MDAT, MCSD) defined first.
+
+enum {
+	TXMODE_STEREO,
+	TXMODE_MONO_L,
+	TXMODE_MONO_R,
+	TXMODE_SHARED_CS
+};
+
+#define TXMODE_MASK		((1 << MONO) | (1 << MDAT) | (1 << MCSD))
+
+static const uint8_t txmode_bits[4] = {
+	0,
+	(1 << MONO) | (1 << MCSD),
+	(1 << MONO) | (1 << MCSD) | (1 << MDAT),
+	(1 << MCSD)
+};
+
+// Channel mode carried in channel status byte 1
+#define TXMODE_CS1(mode)	(((mode) == TXMODE_MONO_L || (mode) == TXMODE_MONO_R) ? CS1_MODE_MONO : CS1_MODE_2CH)
+
+#endif
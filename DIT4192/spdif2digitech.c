@@ -2,6 +2,8 @@
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
 #include <util/delay.h>
+#include "../common/pt.h"
+#include "dit4192_chstat.h"
 
 #define DIT4192_CS	PB4
 #define SCK			PB2
@@ -10,6 +12,12 @@
 #define SELECT		PORTB &= ~_BV(DIT4192_CS);
 #define DESELECT	PORTB |= _BV(DIT4192_CS);
 
+// S/PDIF receiver status (receiver outputs, RXP is fed from the same stream)
+#define RX_UNLOCK	PA0		// 1 = receiver not locked
+#define RX_NPCM		PA1		// 1 = non-PCM stream
+#define RX_FS0		PA2		// FS[1:0] - detected sampling frequency
+#define RX_FS1		PA3		// 00 = 44.1kHz, 01 = 48kHz, 10 = 32kHz, 11 = out of range
+
 /******************************************************************************************************************
  *
  * DIT4192 Registers
@@ -142,18 +150,114 @@
 
 #define	INTERRUPT_STATUS				0x04
 
+#define BTI		0	// Buffer Transfer Interrupt Status (clears on read)
+
 #define	INTERRUPT_MASK					0x05
 
 #define	INTERRUPT_MODE					0x06
 
 #define	CHANNEL_STATUS_BUFFER_CONTROL	0x07
 
+#define BTD		0	// Buffer Transfer Disable (Defaults to 0)
+					// When set to 1, the User Access (UA) buffer is not transferred to the Transmitter Access (TA) buffer.
+
+#define CHANNEL_STATUS_BUFFER			0x08	// A0, B0, A1, B1 ... A23 (0x36), B23 (0x37)
+
+
+/******************************************************************************************************************
+ *
+ * Channel status policy
+ *
+ * The encoder path sends a channel status block rebuilt from CS_POLICY instead of whatever the source had, so
+ * units that refuse copy-protected, professional or odd-category streams still take it. In BYPASS the
+ * incoming block goes out untouched; CSP_NO_BYPASS keeps every stream on the encoder so the policy always
+ * applies.
+ *
+ * Only the bytes that differ from the last block sent are written, as one burst between BTD = 1 and BTD = 0,
+ * and BTI is polled to confirm the block was taken over at a block boundary.
+ *
+ ******************************************************************************************************************/
+#define CSP_CONSUMER		0x01	// Consumer format (else professional)
+#define CSP_COPY_OK			0x02	// Clear copy inhibit (consumer)
+#define CSP_CATEGORY		0x04	// Category code = CS_POLICY_CATEGORY (consumer)
+#define CSP_FS				0x08	// Sample rate from the receiver FS pins (else not indicated)
+#define CSP_NO_BYPASS		0x10	// Never pass the source block through
+
+#ifndef CS_POLICY
+#define CS_POLICY			(CSP_CONSUMER | CSP_COPY_OK | CSP_CATEGORY | CSP_FS)
+#endif
+#ifndef CS_POLICY_CATEGORY
+#define CS_POLICY_CATEGORY	CS1_C_CAT_GENERAL
+#endif
+
+#define CS_BTI_TIMEOUT_MS	8		// > one block at 32kHz (6ms)
+#define CS_BTI_TIMEOUT		(CS_BTI_TIMEOUT_MS * 125)	// Timer0 ticks
+
 
 uint8_t SPISend (uint8_t b);
 void DIT4192WriteReg (uint8_t reg, uint8_t value);
 uint8_t DIT4192ReadReg (uint8_t reg);
 
 
+/******************************************************************************************************************
+ *
+ * Output path
+ *
+ * BYPASS: RXP goes straight to the line driver (BYPAS = 1). Used when the incoming stream is something the
+ *         Digitech takes as is: locked, PCM, 44.1 or 48kHz.
+ * ENCODE: the on-chip encoder re-encodes the serial port (fed from the receiver through the SRC at the output
+ *         rate). Used for everything else; muted while the receiver is unlocked or the stream is non-PCM, so
+ *         the Digitech keeps a valid, silent stream to stay locked to.
+ *
+ * A change of receiver status has to hold for PATH_SETTLE_MS before the path follows it. A switch mutes the
+ * encoder, waits out the frame in flight, parks the line driver (TXOFF) while BYPAS changes and enables it
+ * again, so the Digitech sees silence and a clean break instead of a torn biphase frame. Timer0 (16-bit,
+ * 8us) measures each switch from the first register write until the driver is back on.
+ *
+ ******************************************************************************************************************/
+#define PATH_SETTLE_MS		20
+#define PATH_FRAME_US		50		// > one frame at 32kHz; spun, shorter than a wake-up
+
+#define BYPASS_FS_OK		(_BV(0) | _BV(1))	// FS codes passed through: 44.1k, 48k
+
+#define RXS_LOCK			0x01
+#define RXS_PCM				0x02
+#define RXS_FS_OK			0x04
+
+enum {
+	PATH_ENCODE,
+	PATH_BYPASS
+};
+
+static uint8_t tx_ctrl = 0;					// TRANSMITTER_CONTROL shadow
+static uint8_t path = PATH_ENCODE;
+static uint8_t rx_last = 0;
+static uint8_t rx_settle = 0;
+
+volatile uint8_t path_switches = 0;
+volatile uint16_t path_switch_last = 0;		// Timer0 ticks (8us)
+volatile uint16_t path_switch_max = 0;
+
+static chstat_t chstat;
+static uint8_t cs_sent[CS_BYTES];			// Last block written to the UA buffer
+static uint8_t cs_fs = 0xff;				// Receiver FS code the block was built for
+
+volatile uint8_t cs_updates = 0;
+volatile uint8_t cs_update_fails = 0;		// No BTI within one block
+
+static pt_t pt_cs;
+static uint8_t cs_busy = 0;					// CsWrite () waiting for BTI
+
+uint8_t RxStatus (void);
+void CsProc (void);
+PT_THREAD(CsWrite (pt_t *pt));
+void PathProc (void);
+void PathSwitch (uint8_t to);
+void TxCtrlWrite (uint8_t value);
+uint16_t Ticks (void);
+void SleepUntil (uint16_t t);
+
+
 int main () {
 
 	DDRB = _BV(DIT4192_CS) | _BV(SCK) /* SCK */ | _BV(DOUT) /* DO !!! */;
@@ -171,15 +275,200 @@ int main () {
 
 	// DIT4192ReadReg (AUDIO_SERIAL_PORT_CONTROL);
 
-	cli ();
-	set_sleep_mode (SLEEP_MODE_PWR_DOWN);	
-	sleep_cpu ();
+	// Timer0: 16-bit, clk/64 (8us @ 8MHz), free running
+	TCCR0A = _BV(TCW0);
+	TCCR0B = _BV(CS01) | _BV(CS00);
+	TIMSK |= _BV(OCIE0A);		// compare A: wake up from SleepUntil ()
+	set_sleep_mode (SLEEP_MODE_IDLE);
+
+	// Start on the encoder, muted, until the receiver status has settled
+	TxCtrlWrite (_BV(MUTE));
+
+	_delay_ms (10);		// PDN = 0 to the first channel status buffer access
+	ChStatClear (&chstat);
+
+	while (1) {
+		PathProc ();
+		SleepUntil (Ticks () + 125);	// 1ms
+	}
+}
 
-	// just in case
-	while (1);
+
+uint8_t RxStatus (void) {
+uint8_t pins = PINA;
+uint8_t st = 0;
+	if (!(pins & _BV(RX_UNLOCK))) {
+		st |= RXS_LOCK;
+	}
+	if (!(pins & _BV(RX_NPCM))) {
+		st |= RXS_PCM;
+	}
+	if (BYPASS_FS_OK & _BV((pins >> RX_FS0) & 0x03)) {
+		st |= RXS_FS_OK;
+	}
+	return (st);
 }
 
 
+// Called every 1ms
+void PathProc (void) {
+uint8_t st = RxStatus ();
+uint8_t mute;
+
+	if (st != rx_last) {
+		rx_last = st;
+		rx_settle = 0;
+		return;
+	}
+	if (rx_settle < PATH_SETTLE_MS) {
+		rx_settle++;
+		return;
+	}
+
+	CsProc ();
+
+	if (!(CS_POLICY & CSP_NO_BYPASS) && st == (RXS_LOCK | RXS_PCM | RXS_FS_OK)) {
+		if (path != PATH_BYPASS) {
+			PathSwitch (PATH_BYPASS);
+		}
+		return;
+	}
+
+	if (path != PATH_ENCODE) {
+		PathSwitch (PATH_ENCODE);
+	}
+
+	mute = (st & (RXS_LOCK | RXS_PCM)) != (RXS_LOCK | RXS_PCM);
+	if (mute != !!(tx_ctrl & _BV(MUTE))) {
+		TxCtrlWrite (mute ? (tx_ctrl | _BV(MUTE)) : (tx_ctrl & ~_BV(MUTE)));
+	}
+}
+
+
+void PathSwitch (uint8_t to) {
+uint16_t t0 = Ticks ();
+uint16_t dt;
+
+	if (!(tx_ctrl & _BV(MUTE))) {
+		TxCtrlWrite (tx_ctrl | _BV(MUTE));
+		_delay_us (PATH_FRAME_US);
+	}
+	TxCtrlWrite (tx_ctrl | _BV(TXOFF));
+
+	if (to == PATH_BYPASS) {
+		TxCtrlWrite (_BV(BYPAS) | _BV(TXOFF));
+		TxCtrlWrite (_BV(BYPAS));
+	} else {
+		TxCtrlWrite (_BV(MUTE) | _BV(TXOFF));	// PathProc() unmutes once the stream is usable
+		TxCtrlWrite (_BV(MUTE));
+	}
+	path = to;
+
+	dt = Ticks () - t0;
+	path_switch_last = dt;
+	if (dt > path_switch_max) {
+		path_switch_max = dt;
+	}
+	path_switches++;
+}
+
+
+// Rebuild the channel status when the measured rate changes
+void CsProc (void) {
+static const uint8_t fs_map[4] = { CS_FS_44K1, CS_FS_48K, CS_FS_32K, CS_FS_NA };
+uint8_t fs = (PINA >> RX_FS0) & 0x03;
+
+	if (cs_busy) {
+		cs_busy = PT_SCHEDULE (CsWrite (&pt_cs));
+		return;
+	}
+	if (fs == cs_fs) {
+		return;
+	}
+	cs_fs = fs;
+
+	fs = (CS_POLICY & CSP_FS) ? fs_map[fs] : CS_FS_NA;
+	if (CS_POLICY & CSP_CONSUMER) {
+		ChStatConsumer (&chstat, fs, CS_POLICY & CSP_COPY_OK,
+						(CS_POLICY & CSP_CATEGORY) ? CS_POLICY_CATEGORY : CS1_C_CAT_GENERAL);
+	} else {
+		ChStatPro (&chstat, fs, CS0_EMPH_NONE);
+	}
+	if (ChStatCRC (&chstat)) {
+		PT_INIT (&pt_cs);
+		cs_busy = PT_SCHEDULE (CsWrite (&pt_cs));
+	}
+}
+
+
+// Burst the bytes that differ from the last block, A and B, then wait for
+// BTI, checked once per CsProc () call
+PT_THREAD(CsWrite (pt_t *pt)) {
+static uint16_t t0;
+static uint8_t bti;
+uint8_t lo, hi;
+
+	PT_BEGIN (pt);
+
+	if (!ChStatDiff (chstat.b, cs_sent, &lo, &hi)) {
+		PT_EXIT (pt);
+	}
+
+	DIT4192WriteReg (CHANNEL_STATUS_BUFFER_CONTROL, _BV(BTD));
+	DIT4192ReadReg (INTERRUPT_STATUS);		// drop a stale BTI
+
+	SELECT;
+	ChStatBurst (chstat.b, cs_sent, lo, hi);
+	DESELECT;
+
+	DIT4192WriteReg (CHANNEL_STATUS_BUFFER_CONTROL, 0);
+
+	t0 = Ticks ();
+	PT_WAIT_UNTIL (pt, (bti = DIT4192ReadReg (INTERRUPT_STATUS) & _BV(BTI))
+					|| (uint16_t) (Ticks () - t0) >= CS_BTI_TIMEOUT);
+	if (bti) {
+		cs_updates++;
+	} else {
+		cs_update_fails++;
+	}
+
+	PT_END (pt);
+}
+
+
+void TxCtrlWrite (uint8_t value) {
+	tx_ctrl = value;
+	DIT4192WriteReg (TRANSMITTER_CONTROL, value);
+}
+
+
+uint16_t Ticks (void) {
+uint8_t l = TCNT0L;		// low byte first, latches TCNT0H
+	return (((uint16_t) TCNT0H << 8) | l);
+}
+
+
+// Idle until Ticks () reaches t; the compare match wakes the core. A
+// match between the check and sleep_cpu () is still pending at sei (), so
+// it wakes the core right away.
+void SleepUntil (uint16_t t) {
+	OCR0B = t >> 8;			// 16-bit compare, high byte first
+	OCR0A = t & 0xff;
+
+	cli ();
+	while ((int16_t) (Ticks () - t) < 0) {
+		sleep_enable ();
+		sei ();
+		sleep_cpu ();
+		sleep_disable ();
+		cli ();
+	}
+	sei ();
+}
+
+EMPTY_INTERRUPT (TIMER0_COMPA_vect);
+
+
 uint8_t SPISend (uint8_t b) {
 	
 	USIDR = b;
@@ -0,0 +1,9 @@
+#ifndef TEST_PGMSPACE_H
+#define TEST_PGMSPACE_H
+
+// Host build: flash tables are plain const data
+
+#define PROGMEM
+#define pgm_read_byte(p)	(*(const uint8_t *) (p))
+
+#endif
@@ -0,0 +1,119 @@
+// Host test for dit4192_chstat.h: make && ./chstat_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../dit4192_chstat.h"
+
+static int failures = 0;
+
+#define CHECK(cond)															\
+	do {																	\
+		if (!(cond)) {														\
+			printf ("%s:%d: %s\n", __FILE__, __LINE__, #cond);			\
+			failures++;														\
+		}																	\
+	} while (0)
+
+static uint8_t rev8 (uint8_t b) {
+uint8_t r = 0, i;
+	for (i = 0; i < 8; i++) {
+		r = (r << 1) | ((b >> i) & 1);
+	}
+	return (r);
+}
+
+// Bit-serial CRC-8/EBU (poly 0x1d, init 0xff, reflected in and out) over
+// bytes in transmission order, LSB first
+static uint8_t crc8_ebu (const uint8_t *p, uint8_t n) {
+uint8_t crc = 0xff, i;
+	while (n--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 1) ? (crc >> 1) ^ rev8 (0x1d) : (crc >> 1);
+		}
+	}
+	return (crc);
+}
+
+// The buffer holds channel status bit 0 in the MSB, so the wire byte of
+// b[n] is rev8 (b[n]) and the CRCC is rev8 of the EBU CRC
+static uint8_t crcc_ref (const chstat_t *cs) {
+uint8_t wire[CS_CRCC], i;
+	for (i = 0; i < CS_CRCC; i++) {
+		wire[i] = rev8 (cs->b[i]);
+	}
+	return (rev8 (crc8_ebu (wire, CS_CRCC)));
+}
+
+static void test_crc_check_value (void) {
+const char *s = "123456789";
+uint8_t crc = 0xff, i;
+
+	CHECK (crc8_ebu ((const uint8_t *) s, 9) == 0x97);
+
+	// Table path, MSB first over the bit-reversed bytes
+	for (i = 0; i < 9; i++) {
+		crc = pgm_read_byte (&chstat_crc8[crc ^ rev8 (s[i])]);
+	}
+	CHECK (rev8 (crc) == 0x97);
+}
+
+static void test_crc_blocks (void) {
+chstat_t cs;
+uint16_t k;
+uint8_t n;
+
+	srand (1);
+	ChStatClear (&cs);
+	ChStatPro (&cs, CS_FS_48K, CS0_EMPH_NONE);
+	CHECK (ChStatCRC (&cs) == 1);
+	CHECK (cs.b[CS_CRCC] == crcc_ref (&cs));
+	CHECK (ChStatCRC (&cs) == 0);		// nothing changed
+
+	// Incremental: only from the first changed byte on
+	for (k = 0; k < 1000; k++) {
+		n = rand () % CS_CRCC;
+		ChStatSet (&cs, n, 0xff, rand ());
+		if (n == 0) {
+			cs.b[0] |= CS0_PRO;
+		}
+		ChStatCRC (&cs);
+		CHECK (cs.b[CS_CRCC] == crcc_ref (&cs));
+	}
+}
+
+static void test_profiles (void) {
+chstat_t cs;
+
+	ChStatClear (&cs);
+	ChStatPro (&cs, CS_FS_96K, CS0_EMPH_NONE);
+	CHECK (cs.b[0] == (CS0_PRO | CS0_EMPH_NONE | CS0_FS_NA));
+	CHECK ((cs.b[1] & CS1_MODE_MASK) == CS1_MODE_2CH);
+	CHECK ((cs.b[4] & CS4_FS_MASK) == CS4_FS_96K);
+
+	ChStatPro (&cs, CS_FS_48K, CS0_EMPH_NONE);
+	CHECK ((cs.b[0] & CS0_FS_MASK) == CS0_FS_48K);
+	CHECK ((cs.b[4] & CS4_FS_MASK) == 0);
+	CHECK (cs.dirty == 0);
+
+	ChStatClear (&cs);
+	ChStatConsumer (&cs, CS_FS_44K1, 1, CS1_C_CAT_CD);
+	ChStatCRC (&cs);
+	CHECK (cs.b[0] == CS0_C_COPY_OK);
+	CHECK (cs.b[1] == CS1_C_CAT_CD);
+	CHECK ((cs.b[3] & CS3_C_FS_MASK) == CS3_C_FS_44K1);
+	CHECK (cs.b[CS_CRCC] == 0);		// no CRCC in consumer blocks
+}
+
+int main (void) {
+	test_crc_check_value ();
+	test_crc_blocks ();
+	test_profiles ();
+
+	if (failures) {
+		printf ("%d failed\n", failures);
+		return (1);
+	}
+	printf ("ok\n");
+	return (0);
+}
@@ -0,0 +1,139 @@
+// Host test for the channel status burst of spdif2digitech.c CsWrite ()
+// (ChStatDiff, ChStatBurst): make && ./cswrite_test
+
+#include <stdio.h>
+#include <string.h>
+#include "../dit4192_chstat.h"
+
+static int failures = 0;
+
+#define CHECK(cond)															\
+	do {																	\
+		if (!(cond)) {														\
+			printf ("%s:%d: %s\n", __FILE__, __LINE__, #cond);			\
+			failures++;														\
+		}																	\
+	} while (0)
+
+// SPI bytes sent since the last spi_clear ()
+static uint8_t spi[2 + CS_BYTES * 2];
+static uint8_t spi_n;
+
+uint8_t SPISend (uint8_t b) {
+	if (spi_n < sizeof (spi)) {
+		spi[spi_n] = b;
+	}
+	spi_n++;
+	return (0xff);
+}
+
+static void spi_clear (void) {
+	spi_n = 0;
+}
+
+// As CsWrite (): nothing when the blocks match, else one burst
+static uint8_t cs_write (const chstat_t *cs, uint8_t *sent, uint8_t *lo, uint8_t *hi) {
+	spi_clear ();
+	if (!ChStatDiff (cs->b, sent, lo, hi)) {
+		return (0);
+	}
+	ChStatBurst (cs->b, sent, *lo, *hi);
+	return (1);
+}
+
+static void test_unchanged (void) {
+chstat_t cs;
+uint8_t sent[CS_BYTES], lo = 0xaa, hi = 0xaa;
+
+	ChStatClear (&cs);
+	ChStatConsumer (&cs, CS_FS_48K, 1, CS1_C_CAT_GENERAL);
+	ChStatCRC (&cs);
+	memcpy (sent, cs.b, CS_BYTES);
+
+	CHECK (cs_write (&cs, sent, &lo, &hi) == 0);
+	CHECK (spi_n == 0);
+	CHECK (lo == 0xaa && hi == 0xaa);
+}
+
+// Consumer block, rate change: byte 3 only, no CRCC
+static void test_single_byte (void) {
+chstat_t cs;
+uint8_t sent[CS_BYTES], lo, hi;
+
+	ChStatClear (&cs);
+	ChStatConsumer (&cs, CS_FS_48K, 1, CS1_C_CAT_GENERAL);
+	ChStatCRC (&cs);
+	memcpy (sent, cs.b, CS_BYTES);
+
+	ChStatConsumer (&cs, CS_FS_44K1, 1, CS1_C_CAT_GENERAL);
+	ChStatCRC (&cs);
+	CHECK (cs_write (&cs, sent, &lo, &hi) == 1);
+	CHECK (lo == 3 && hi == 3);
+	CHECK (spi_n == 4);
+	CHECK (spi[0] == CS_BUF_REG + 3 * 2);	// A3, write, auto-increment
+	CHECK (spi[1] == 0xff);
+	CHECK (spi[2] == cs.b[3]);				// A3
+	CHECK (spi[3] == cs.b[3]);				// B3
+	CHECK ((cs.b[3] & CS3_C_FS_MASK) == CS3_C_FS_44K1);
+	CHECK (memcmp (sent, cs.b, CS_BYTES) == 0);
+
+	CHECK (cs_write (&cs, sent, &lo, &hi) == 0);
+}
+
+// Two bytes apart: the bytes in between go out too, unchanged
+static void test_range (void) {
+chstat_t cs;
+uint8_t sent[CS_BYTES], lo, hi, i;
+
+	ChStatClear (&cs);
+	ChStatConsumer (&cs, CS_FS_48K, 1, CS1_C_CAT_GENERAL);
+	ChStatCRC (&cs);
+	memcpy (sent, cs.b, CS_BYTES);
+
+	ChStatConsumer (&cs, CS_FS_32K, 0, CS1_C_CAT_GENERAL);
+	ChStatCRC (&cs);
+	CHECK (cs_write (&cs, sent, &lo, &hi) == 1);
+	CHECK (lo == 0 && hi == 3);
+	CHECK (spi_n == 2 + 4 * 2);
+	CHECK (spi[0] == CS_BUF_REG);
+	for (i = 0; i < 4; i++) {
+		CHECK (spi[2 + i * 2] == cs.b[i]);
+		CHECK (spi[3 + i * 2] == cs.b[i]);
+	}
+}
+
+// Professional block: one byte changes the CRCC as well, so the burst
+// runs to byte 23
+static void test_pro_crcc (void) {
+chstat_t cs;
+uint8_t sent[CS_BYTES], lo, hi;
+
+	ChStatClear (&cs);
+	ChStatPro (&cs, CS_FS_48K, CS0_EMPH_NONE);
+	ChStatCRC (&cs);
+	memcpy (sent, cs.b, CS_BYTES);
+
+	ChStatSet (&cs, 2, CS2_AUX_MASK, 0);
+	ChStatCRC (&cs);
+	CHECK (cs_write (&cs, sent, &lo, &hi) == 1);
+	CHECK (lo == 2 && hi == CS_CRCC);
+	CHECK (spi_n == 2 + (CS_CRCC - 1) * 2);
+	CHECK (spi[0] == CS_BUF_REG + 2 * 2);
+	CHECK (spi[spi_n - 2] == cs.b[CS_CRCC]);
+	CHECK (spi[spi_n - 1] == cs.b[CS_CRCC]);
+	CHECK (memcmp (sent, cs.b, CS_BYTES) == 0);
+}
+
+int main (void) {
+	test_unchanged ();
+	test_single_byte ();
+	test_range ();
+	test_pro_crcc ();
+
+	if (failures) {
+		printf ("%d failed\n", failures);
+		return (1);
+	}
+	printf ("ok\n");
+	return (0);
+}
@@ -0,0 +1,98 @@
+// Host test for dit4192_txmode.h: make && ./txmode_test
+
+#include <stdio.h>
+
+// TRANSMI_CTRL (register 1) bits, DIT4192 data sheet
+#define MONO	4
+#define MDAT	5
+#define MCSD	6
+
+#include "../dit4192_txmode.h"
+
+static int failures = 0;
+
+#define CHECK(cond)															\
+	do {																	\
+		if (!(cond)) {														\
+			printf ("%s:%d: %s\n", __FILE__, __LINE__, #cond);			\
+			failures++;														\
+		}																	\
+	} while (0)
+
+#define BIT(n)	(1 << (n))
+
+// What goes out in each sub-frame, 'L'/'R' audio and 'A'/'B' channel
+// status buffer
+typedef struct {
+	char data_a, data_b;
+	char cs_a, cs_b;
+} subframes_t;
+
+// Transmitter model, TRANSMI_CTRL bits as the data sheet describes them:
+// MONO sends one channel's data in both sub-frames, MDAT picks it (0 left,
+// 1 right); MCSD sends one channel status buffer in both sub-frames, the
+// one of the channel MDAT picks
+static subframes_t txmodel (uint8_t ctrl) {
+subframes_t s = { 'L', 'R', 'A', 'B' };
+	if (ctrl & BIT(MONO)) {
+		s.data_a = s.data_b = (ctrl & BIT(MDAT)) ? 'R' : 'L';
+	}
+	if (ctrl & BIT(MCSD)) {
+		s.cs_a = s.cs_b = (ctrl & BIT(MDAT)) ? 'B' : 'A';
+	}
+	return (s);
+}
+
+static const subframes_t txmode_want[4] = {
+	{ 'L', 'R', 'A', 'B' },		// TXMODE_STEREO
+	{ 'L', 'L', 'A', 'A' },		// TXMODE_MONO_L
+	{ 'R', 'R', 'B', 'B' },		// TXMODE_MONO_R
+	{ 'L', 'R', 'A', 'A' }		// TXMODE_SHARED_CS
+};
+
+int main (void) {
+uint8_t m, i;
+chstat_t cs;
+uint8_t before[CS_BYTES];
+subframes_t s;
+
+	for (m = 0; m < 4; m++) {
+		s = txmodel (txmode_bits[m]);
+		CHECK (s.data_a == txmode_want[m].data_a);
+		CHECK (s.data_b == txmode_want[m].data_b);
+		CHECK (s.cs_a == txmode_want[m].cs_a);
+		CHECK (s.cs_b == txmode_want[m].cs_b);
+		CHECK ((txmode_bits[m] & ~TXMODE_MASK) == 0);
+	}
+
+	CHECK (TXMODE_CS1 (TXMODE_STEREO) == CS1_MODE_2CH);
+	CHECK (TXMODE_CS1 (TXMODE_MONO_L) == CS1_MODE_MONO);
+	CHECK (TXMODE_CS1 (TXMODE_MONO_R) == CS1_MODE_MONO);
+	CHECK (TXMODE_CS1 (TXMODE_SHARED_CS) == CS1_MODE_2CH);
+
+	// Mode change on a professional block: only byte 1 and the CRCC move
+	ChStatClear (&cs);
+	ChStatPro (&cs, CS_FS_48K, CS0_EMPH_NONE);
+	ChStatCRC (&cs);
+	for (i = 0; i < CS_BYTES; i++) {
+		before[i] = cs.b[i];
+	}
+	ChStatSet (&cs, 1, CS1_MODE_MASK, TXMODE_CS1 (TXMODE_MONO_L));
+	CHECK (cs.dirty == 1);
+	CHECK (ChStatCRC (&cs) == 1);
+	CHECK ((cs.b[1] & CS1_MODE_MASK) == CS1_MODE_MONO);
+	CHECK ((cs.b[1] & ~CS1_MODE_MASK) == (before[1] & ~CS1_MODE_MASK));
+	CHECK (cs.b[CS_CRCC] != before[CS_CRCC]);
+	for (i = 0; i < CS_BYTES; i++) {
+		if (i != 1 && i != CS_CRCC) {
+			CHECK (cs.b[i] == before[i]);
+		}
+	}
+
+	if (failures) {
+		printf ("%d failed\n", failures);
+		return (1);
+	}
+	printf ("ok\n");
+	return (0);
+}
@@ -4,6 +4,16 @@
 #include 
 #include 
 #include 
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include <avr/sleep.h>
+#include "../common/ringbuf.h"
+#include "../common/pt.h"
+#ifdef PGA_READBACK
+#include "../common/spical.h"
+#else
+#define SPICAL_HALF()
+#endif
 
 /*
     PD7 O SCLK (PGA2311)
@@ -25,9 +35,9 @@
 
     PB7 I SELECTOR SW[5] "line1"
     PB6 I SELECTOR SW[4] "opt3"
-    PB5 - (ISP: SCK)
-    PB4 - (ISP: MISO)
-    PB3 - (ISP: MOSI)
+    PB5 I HP_DETECT (0: Headphone plugged) (ISP: SCK)
+    PB4 O DEBUG_TXD (Soft UART 9600bps 8N1) (ISP: MISO)
+    PB3 I SDO (PGA2311 CS1/CS2, Hi-Z while CS=1, read-back) (ISP: MOSI)
     PB2 O CS1 (PGA2311_HPA) 
     PB1 O CS2 (PGA2311_LINE)
     PB0 O SDI (PGA2311)
@@ -39,6 +49,211 @@
 static uint8_t current_sel_sw_state;
 static uint8_t idle_count = 0;
 
+/*
+    Control loop tuning
+
+    Each of these can be overridden with -D, so a build (or a simulavr run
+    over recorded pot and switch traces) can sweep them.
+*/
+#ifndef ADC_HYST
+#define ADC_HYST        2         // ADC steps a pot has to move to count as changed
+#endif
+#ifndef IDLE_TICKS
+#define IDLE_TICKS      200       // Ticks (5ms) without a change until the gain is no longer rewritten
+#endif
+#ifndef SEL_DEBOUNCE
+#define SEL_DEBOUNCE    1         // Ticks (5ms) the selector must hold before the route switches
+#endif
+#ifndef TRIM_SHIFT
+#define TRIM_SHIFT      3         // Trim pot ADC to gain steps (0.5dB)
+#endif
+
+/*
+    RAM budget (ATmega8: 1KB SRAM)
+
+    .data/.bss/heap are taken from the linker symbols. The free area between
+    _end and RAMEND is painted with STACK_CANARY before the stack is set up
+    (.init1), so the bytes the stack has never touched can be counted later
+    as the high-water mark. After a watchdog reset the paint is skipped so
+    the warm restore is not held up; the previous run's paint is still
+    there, and so is its high-water mark.
+
+    Soft UART on PB4 (ISP header MISO) reports the figures at boot and every
+    time the stack grows deeper. The scan takes a few ms, so the main loop
+    runs it once every STACK_CHECK_TICKS ticks, not on every wake-up. Text
+    goes through log_ring, so ISRs can log too; the main loop drains it.
+    For simulavr, build with -DSIM_CONSOLE=0x20 and run
+    "simulavr -d atmega8 -F 1000000 -W 0x20,- -f main.elf".
+*/
+#define STACK_CANARY    0xC5
+#define STACK_MARGIN    32        // Warn below 32 bytes of untouched stack
+#define STACK_CHECK_TICKS   200   // 1s
+
+#define SUART_TXD       4         // PB4
+#define SUART_BAUD      9600
+#define SUART_LOOP_US   9         // Bit loop overhead @1MHz
+
+RINGBUF(log_ring, char, 128)   // log_*() -> main loop -> soft UART, one tick of reports
+
+static uint8_t log_drops = 0;
+
+extern uint8_t __data_start, __data_end, __bss_start, __bss_end, __heap_start, _end;
+extern char *__brkval __attribute__((weak));    // Only present when malloc() is linked
+
+/*
+    Watchdog supervision / warm restart
+
+    The watchdog is only kicked from the main loop once every task has checked
+    in (TASK_TICK: tick_tasks() completed, TASK_MAIN: main loop alive).
+    Routing, gain and relay state are kept in .noinit with a checksum; after a
+    watchdog reset they are written back straight away instead of going
+    through the 500ms cold boot. The route pins come back first, in .init3
+    ahead of the .data/.bss setup; gains and relay follow in init_devices().
+*/
+#define WDT_TIMEOUT     WDTO_250MS
+
+#define TASK_TICK       0x01
+#define TASK_MAIN       0x02
+#define TASK_ALL        (TASK_TICK | TASK_MAIN)
+
+#define ROUTE_C_MASK    (_BV(5) | _BV(3) | _BV(2) | _BV(1))    // SEL_AIN1, DIGIIF_SEL[1:0], SEL_AIN2
+#define ROUTE_D_MASK    (_BV(0))                                // SEL_DIN
+#define WARM_MAGIC      0xA5
+
+typedef struct {
+    uint8_t sel_sw_state;
+    uint8_t portc;            // PORTC & ROUTE_C_MASK
+    uint8_t portd;            // PORTD & ROUTE_D_MASK
+    uint8_t hpa_gain;        // CS1
+    uint8_t line_gain;        // CS2
+    uint8_t relay;
+    uint8_t wdt_resets;
+    uint8_t checksum;
+} warm_state_t;
+
+warm_state_t warm_state __attribute__ ((section (".noinit")));
+uint8_t reset_cause __attribute__ ((section (".noinit")));    // MCUCSR at reset
+
+static volatile uint8_t task_checkin = 0;
+
+/*
+    5ms tick
+
+    The Timer1 ISR only counts; tick_tasks() runs the per-tick work from the
+    main loop, once per elapsed tick. Sequences that have to wait (selector
+    debounce, cold power-up) are protothreads (common/pt.h) polled from
+    there instead of spinning in _delay_ms().
+*/
+static volatile uint8_t tick = 0;
+static uint8_t tick_done = 0;
+
+static pt_t pt_selector;
+static pt_t pt_powerup;
+static pt_t pt_relay;
+static uint8_t sel_pending = 0;    // Selector change seen, debounce running
+static uint8_t powerup = 0;        // Cold start: power-up sequence running
+
+/*
+    System time
+
+    time_us() is a free-running 32-bit microsecond count: time_base, moved
+    on by 5000 in the tick ISR, plus TCNT1 (1us per count at 1MHz). A
+    compare match still pending (interrupts off) is accounted for, so the
+    count never steps back. It wraps after about 71 minutes; compare times
+    with time_reached() only.
+*/
+static volatile uint32_t time_base = 0;    // us at the last compare match
+
+#define time_reached(t)     ((int32_t) (time_us() - (t)) >= 0)
+
+uint32_t time_us(void)
+{
+    uint32_t base;
+    uint16_t cnt;
+    uint8_t sreg = SREG;
+
+    cli();
+    base = time_base;
+    cnt = TCNT1;
+    if ((TIFR & _BV(OCF1A)) && cnt < (OCR1A >> 1)) {
+        base += 5000;    // TCNT1 already cleared, ISR not run yet
+    }
+    SREG = sreg;
+
+    return base + cnt;
+}
+
+static uint16_t tick_us_max = 0;    // Longest tick_tasks() run
+
+/*
+    Headphone jack detect
+
+    Only the active output follows the volume control: HPA (CS1) while a
+    headphone is plugged, LINE (CS2) otherwise. The other PGA2311 is muted
+    and no longer written. On a jack change the active output is faded to
+    mute in HP_RAMP_STEP steps per tick before the other one takes over
+    (PGA2311 zero crossing detection takes care of the step back up).
+
+    HP_DETECT is sampled on the 5ms tick (the ATmega8 has no pin change
+    interrupt).
+*/
+#define HP_DET          5         // PB5
+#ifndef HP_DEBOUNCE
+#define HP_DEBOUNCE     4         // Ticks (5ms) the jack level must be stable
+#endif
+#define HP_RAMP_STEP    16        // 8dB per tick
+
+static uint8_t jack_level;        // Last level seen on HP_DETECT
+static uint8_t jack_stable;       // Ticks since the last edge
+static uint8_t hp_active;         // 1: HPA (CS1) active, 0: LINE (CS2) active
+
+/*
+    Output relay economizer
+
+    The relay is pulled in at full drive for RELAY_PULLIN_MS and then held
+    with a RELAY_HOLD_DUTY/256 PWM. PD6 is no timer output on the ATmega8
+    (OC2 is PB3), so Timer2 runs the PWM through its overflow/compare
+    interrupts at clk/8 (~490Hz, a few cycles per edge).
+
+    It is released through the mute: with the selector off every position
+    for RELAY_OFF_MS (parked between detents) both outputs go to mute,
+    RELAY_MUTE_MS later the relay opens. Back on a position it closes
+    again and the outputs stay muted until it has pulled in.
+*/
+#define RELAY_PULLIN_MS   50
+#define RELAY_OFF_MS      1000
+#define RELAY_MUTE_MS     20        // > PGA2311 zero-crossing timeout (16ms)
+#define RELAY_HOLD_DUTY   96        // Hold current ~40% of pull-in
+
+static uint8_t relay_pullin = 0;    // Ticks (5ms) left at full drive
+static uint8_t relay_releasing = 0; // relay_release_thread() running
+
+/*
+    PGA2311 read-back (-DPGA_READBACK, needs SDO wired to PB3)
+
+    While a new word is clocked in, the PGA2311 shifts its previous 16-bit
+    word out on SDO. pga2311_write() compares that echo with the word sent
+    last time, so every write verifies the one before it without any extra
+    frame. On a mismatch the error is counted and logged, and the current
+    gain is written once more on the next tick; that rewrite is in turn
+    verified by the following write.
+*/
+#define PGA_LINE        1         // CS2 (PB1)
+#define PGA_HPA         2         // CS1 (PB2)
+#define PGA_SDO         3         // PB3
+
+static uint8_t pga_sent[2];       // Last word written, per device (PGA_xxx - 1)
+static uint8_t pga_errors[2];     // Read-back mismatches, per device
+static uint8_t pga_rewrite = 0;   // Devices to write again: _BV(PGA_xxx - 1)
+
+// SCLK half-period stretch per device, calibrated against the SDO echo
+// at cold start (PGA_READBACK only, otherwise full speed)
+#ifdef PGA_READBACK
+#define EE_SPICAL       ((uint8_t *) 0x00)    // { dly, ~dly } per device
+
+static uint8_t pga_dly[2];
+#endif
+
 volatile uint8_t att_value[256] = {    // ΐJ[u
         0x00,0x00,0x1F,0x2E,0x39,0x41,0x47,0x4D,0x52,0x56,0x5A,0x5D,0x61,0x63,0x66,0x69,
 0x6B,0x6D,0x6F,0x71,0x73,0x75,0x77,0x78,0x7A,0x7B,0x7D,0x7E,0x7F,0x81,0x82,0x83,
@@ -58,30 +273,375 @@ volatile uint8_t att_value[256] = {    // 
         0xCD,0xCD,0xCE,0xCE,0xCE,0xCE,0xCE,0xCE,0xCE,0xCF,0xCF,0xCF,0xCF,0xCF,0xCF,0xD0
         };
 
-void wait_ms(uint16_t t) {
+void stack_paint(void) __attribute__ ((naked, used, section (".init1")));
+
+void stack_paint(void)
+{
+    //    r1 and SP are not valid yet in .init1, assembly only
+    __asm volatile (
+        "    in r24, %1\n"              // Watchdog reset: no paint
+        "    sbrc r24, %2\n"
+        "    rjmp 3f\n"
+        "    ldi r30, lo8(_end)\n"
+        "    ldi r31, hi8(_end)\n"
+        "    ldi r24, %0\n"
+        "    ldi r25, hi8(__stack)\n"
+        "    rjmp 2f\n"
+        "1:  st Z+, r24\n"
+        "2:  cpi r30, lo8(__stack)\n"
+        "    cpc r31, r25\n"
+        "    brlo 1b\n"
+        "    breq 1b\n"
+        "3:\n"
+        :: "i" (STACK_CANARY), "I" (_SFR_IO_ADDR(MCUCSR)), "I" (WDRF));
+}
+
+
+uint8_t warm_state_sum(void)
+{
+    const uint8_t *p = (const uint8_t *) &warm_state;
+    uint8_t n, sum = WARM_MAGIC;
+
+    for (n = 0; n < sizeof(warm_state) - 1; n++) sum += *p++;
+
+    return sum;
+}
+
+
+void warm_state_seal(void)
+{
+    warm_state.checksum = warm_state_sum();
+}
+
+
+uint8_t warm_state_valid(void)
+{
+    return (warm_state.checksum == warm_state_sum());
+}
+
+
+void get_reset_cause(void) __attribute__ ((naked, used, section (".init3")));
+
+void get_reset_cause(void)
+{
+    reset_cause = MCUCSR;
+    MCUCSR = 0;
+    wdt_disable();
+
+    if ((reset_cause & _BV(WDRF)) && warm_state_valid()) {
+        PORTC = warm_state.portc;    // Route pins, before the C runtime init
+        DDRC = ROUTE_C_MASK;
+        PORTD = warm_state.portd;
+        DDRD = ROUTE_D_MASK;
+    }
+}
+
+
+uint16_t stack_free(void)
+{
+    const uint8_t *p = &_end;
+
+    while ((p <= (const uint8_t *) RAMEND) && (*p == STACK_CANARY)) p++;
+
+    return p - &_end;
+}
+
+
+void suart_putc(char c)
+{
+#ifdef SIM_CONSOLE
+    _SFR_MEM8(SIM_CONSOLE) = c;
+#else
+    uint8_t n, sreg = SREG;
+
+    cli();    // Bit timing
+
+    PORTB &= ~_BV(SUART_TXD);    // Start bit
+    _delay_us(1.0E6 / SUART_BAUD - SUART_LOOP_US);
+
+    for (n = 0; n < 8; n++) {
+        if (c & 0x01) {
+            PORTB |= _BV(SUART_TXD);
+        }else{
+            PORTB &= ~_BV(SUART_TXD);
+        }
+        c >>= 1;
+        _delay_us(1.0E6 / SUART_BAUD - SUART_LOOP_US);
+    }
+
+    PORTB |= _BV(SUART_TXD);    // Stop bit
+    _delay_us(1.0E6 / SUART_BAUD - SUART_LOOP_US);
+
+    SREG = sreg;
+#endif
+}
+
+
+void log_putc(char c)
+{
+    if (!log_ring_put(c)) log_drops++;    // Never blocks, also used from ISR
+}
+
+
+void log_flush(void)
+{
+    char c;
+
+    if (log_ring_count() == 0) return;
+
+    while (log_ring_get(&c)) suart_putc(c);
+}
+
+
+void log_puts_P(const char *s)
+{
+    char c;
+
+    while ((c = pgm_read_byte(s++))) log_putc(c);
+}
+
+
+void log_putu(uint16_t v)
+{
+    char buf[5];
+    uint8_t n = 0;
+
+    do {
+        buf[n++] = '0' + (v % 10);
+        v /= 10;
+    } while (v);
+
+    while (n) log_putc(buf[--n]);
+}
+
+
+void ram_report(uint16_t free)
+{
+    log_puts_P(PSTR("RAM data="));
+    log_putu(&__data_end - &__data_start);
+    log_puts_P(PSTR(" bss="));
+    log_putu(&__bss_end - &__bss_start);
+    log_puts_P(PSTR(" heap="));
+    log_putu((&__brkval && __brkval) ? (uint16_t) (__brkval - (char *) &__heap_start) : 0);
+    log_puts_P(PSTR(" stack="));
+    log_putu((RAMEND + 1 - (uint16_t) &_end) - free);
+    log_puts_P(PSTR(" free="));
+    log_putu(free);
+
+    if (log_drops) {
+        log_puts_P(PSTR(" logdrop="));
+        log_putu(log_drops);
+    }
+
+    if (free < STACK_MARGIN) {
+        log_puts_P(PSTR(" STACK LOW"));
+    }
+
+    log_puts_P(PSTR("\r\n"));
+}
+
+
+uint16_t pga2311(uint8_t ATT);
+
+
+void pga2311_write(uint8_t cs, uint8_t gain)
+{
+    uint8_t dev = cs - 1;
+    uint16_t echo;
+
+#ifdef PGA_READBACK
+    spi_dly = pga_dly[dev];
+#endif
+
+    PORTB &= ~_BV(cs);    // CS -> 0
+    echo = pga2311(gain);
+    PORTB |= _BV(cs);    // CS -> 1
+
+#ifdef PGA_READBACK
+    if (echo != (((uint16_t) pga_sent[dev] << 8) | pga_sent[dev])) {
+        pga_errors[dev]++;
+        pga_rewrite |= _BV(dev);
+
+        log_puts_P(PSTR("PGA ERR cs="));
+        log_putu(cs);
+        log_puts_P(PSTR(" n="));
+        log_putu(pga_errors[dev]);
+        log_puts_P(PSTR("\r\n"));
+    } else {
+        pga_rewrite &= ~_BV(dev);
+    }
+#else
+    (void) echo;
+#endif
+
+    pga_sent[dev] = gain;
+
+    if (cs == PGA_HPA) {
+        warm_state.hpa_gain = gain;
+    } else {
+        warm_state.line_gain = gain;
+    }
+}
+
+
+#ifdef PGA_READBACK
+// Two words in, the second one has to echo the first. Only run while the
+// output relay is open: the patterns land in the gain registers.
+static uint8_t spical_test(uint8_t dev)
+{
+    static uint8_t p = 0x5a;
+    uint8_t cs = dev + 1;
+    uint8_t sent = p;
+    uint16_t echo;
 
-    while (t--) _delay_ms(1);     //1ms
+    PORTB &= ~_BV(cs);
+    pga2311(sent);
+    PORTB |= _BV(cs);
 
+    p = ~p + 0x27;
+
+    PORTB &= ~_BV(cs);
+    echo = pga2311(p);
+    PORTB |= _BV(cs);
+
+    pga_sent[dev] = p;    // Keeps the next pga2311_write() check in step
+
+    return echo == (((uint16_t) sent << 8) | sent);
 }
+#endif
 
 
-void init_devices(void)
+void pga2311_recheck(void)
+{
+    if (pga_rewrite & _BV(PGA_LINE - 1)) {
+        pga2311_write(PGA_LINE, warm_state.line_gain);
+    }
+
+    if (pga_rewrite & _BV(PGA_HPA - 1)) {
+        pga2311_write(PGA_HPA, warm_state.hpa_gain);
+    }
+
+    if (pga_rewrite) {
+        warm_state_seal();
+    }
+}
+
+
+
+
+void mute_all(void)
+{
+    // Outputs already at mute are not written again
+    if (warm_state.line_gain) {
+        pga2311_write(PGA_LINE, 0);
+    }
+
+    if (warm_state.hpa_gain) {
+        pga2311_write(PGA_HPA, 0);
+    }
+
+    warm_state_seal();
+}
+
+
+void relay_pwm(uint8_t on)
+{
+    if (on) {
+        OCR2 = RELAY_HOLD_DUTY;
+        TCNT2 = 0;
+        TCCR2 = _BV(CS21);                                 // Normal mode, clk/8
+        TIMSK |= _BV(OCIE2) | _BV(TOIE2);
+    } else {
+        TIMSK &= ~(_BV(OCIE2) | _BV(TOIE2));
+        TCCR2 = 0;
+    }
+}
+
+
+void relay_on(void)
+{
+    relay_pwm(0);
+    PORTD |= _BV(6);    // Output Relay Enable (full drive)
+    relay_pullin = RELAY_PULLIN_MS / 5;
+
+    warm_state.relay = 1;
+    warm_state_seal();
+}
+
+
+void relay_off(void)
+{
+    relay_pwm(0);
+    PORTD &= ~_BV(6);    // Output Relay Disable
+    relay_pullin = 0;
+
+    warm_state.relay = 0;
+    warm_state_seal();
+}
+
+
+void relay_proc(void)
+{
+    if (relay_pullin && (--relay_pullin == 0)) {
+        relay_pwm(1);    // Pulled in, drop to hold current
+    }
+}
+
+
+#ifdef RINGBUF_BENCH
+RINGBUF(bench_ring, uint8_t, 16)
+
+void ringbuf_bench(void)
+{
+    uint16_t t0, t1, t_put, t_get;
+    uint8_t v;
+
+    //    Timer1 counts F_CPU without prescaler: 1 count = 1 cycle
+    //    (called before sei(), restarting TCNT1 keeps clear of the 5ms wrap)
+    TCNT1 = 0;
+    t0 = TCNT1; t1 = TCNT1;
+    t_put = t1 - t0;        // TCNT1 read overhead
+    t_get = t_put;
+
+    t0 = TCNT1; bench_ring_put(0x55); t1 = TCNT1;
+    t_put = (t1 - t0) - t_put;
+
+    t0 = TCNT1; bench_ring_get(&v); t1 = TCNT1;
+    t_get = (t1 - t0) - t_get;
+
+    log_puts_P(PSTR("RINGBUF put="));
+    log_putu(t_put);
+    log_puts_P(PSTR(" get="));
+    log_putu(t_get);
+    log_puts_P(PSTR(" cycles\r\n"));
+}
+#endif
+
+
+void init_devices(uint8_t warm)
 {
 
     //     |[gݒ 0:, 1:o
-    DDRB = 0b00000111;
+    DDRB = 0b00010111;
     DDRC = 0b0101110;
     DDRD = 0b11000011;
 
     //    o̓|[g
     //    ̓|[gA1:vAbv
-    PORTB = 0b11000110;
-    PORTC = 0b0100000;
-    PORTD = 0b00111101;
+    //    Warm: the route pins as restored in .init3, one write per port
+    PORTB = 0b11110110;
+    if (warm) {
+        PORTC = (0b0100000 & ~ROUTE_C_MASK) | warm_state.portc;
+        PORTD = (0b00111101 & ~ROUTE_D_MASK) | warm_state.portd;
+        current_sel_sw_state = warm_state.sel_sw_state;
+    } else {
+        PORTC = 0b0100000;
+        PORTD = 0b00111101;
+    }
 
     // CTC
     TCNT1 = 0;    //    ^C}1̏lݒ
-    OCR1A = 5000;    //    ^C}^JE^1rWX^A, 5ms
+    OCR1A = 4999;    //    ^C}^JE^1rWX^A, 5ms (CTC: 0..4999)
 
     // 15.11.1 ^C}^JE^1䃌WX^A
     TCCR1A = 0b00000000;
@@ -94,18 +654,52 @@ void init_devices(void)
     // 15.11.8 ^C}^JE^1荞݃}XNWX^
     TIMSK = 0b00010000;
 
-    wait_ms(500);        // Wait: 500ms
+    // Headphone jack detect
+    jack_level = bit_is_set(PINB, HP_DET) ? 1 : 0;
+    jack_stable = HP_DEBOUNCE;
+    hp_active = !jack_level;
+
+    if (warm) {
+
+        // Restore gain, skip the power-up wait
+#ifdef PGA_READBACK
+        pga_dly[PGA_LINE - 1] = spical_load(EE_SPICAL);
+        pga_dly[PGA_HPA - 1] = spical_load(EE_SPICAL + 2);
+#endif
+        pga_sent[PGA_HPA - 1] = warm_state.hpa_gain;      // Kept by the PGA2311s
+        pga_sent[PGA_LINE - 1] = warm_state.line_gain;    // across the MCU reset
+        pga2311_write(PGA_HPA, warm_state.hpa_gain);
+        pga2311_write(PGA_LINE, warm_state.line_gain);
+
+        if (warm_state.relay) {
+            relay_on();
+        } else {
+            powerup = 1;    // Reset before the relay closed: power up again
+        }
+
+    } else {
+
+        powerup = 1;        // Relay stays open, see powerup_thread()
+
+        warm_state.sel_sw_state = current_sel_sw_state;
+        warm_state.portc = PORTC & ROUTE_C_MASK;
+        warm_state.portd = PORTD & ROUTE_D_MASK;
+        warm_state.hpa_gain = 0;
+        warm_state.line_gain = 0;
+        warm_state.relay = 0;
+        warm_state.wdt_resets = 0;
+    }
 
-    // o̓[
-    PORTD |= _BV(6);    // Output Relay Enable
+    warm_state_seal();
 
 }
 
 
 
-void pga2311(uint8_t ATT)
+uint16_t pga2311(uint8_t ATT)
 {
     int8_t n, m;
+    uint16_t echo = 0;
 
     PORTD &= ~_BV(7);    // SCLK -> 0
 
@@ -120,126 +714,310 @@ void pga2311(uint8_t ATT)
                 PORTB &= ~_BV(0);
             }
 
+            // SDO read (previous word, MSB first)
+            echo <<= 1;
+            if (bit_is_set(PINB, PGA_SDO)) {
+                echo |= 1;
+            }
+
             // MC write
             PORTD |= _BV(7);    // SCLK -> 1
+            SPICAL_HALF();
             PORTD &= ~_BV(7);    // SCLK -> 0
+            SPICAL_HALF();
         }
     }
 
     PORTB &= ~_BV(0);    // SDI -> 0
+
+    return echo;
 }
 
 
 
-uint8_t selector_proc(void)
+/*
+    Audio path
+
+    path_select() owns the input routing. The target pin state of each
+    selector position comes from path_routes[]; only the pins that differ
+    are changed, all in one write per port. The outputs are muted while
+    the selector is between positions or debouncing, and by path_select()
+    when the audible path changes (SEL_DIN, SEL_AIN1/2, or DIGIIF_SEL while
+    the DAC input is selected); only those not already at mute.
+    attenuation_proc() brings the gain back on the next tick. The time
+    from the first mute of the change to the first non-zero gain is logged
+    as "PATH mute=", also when the route ends up where it was.
+*/
+typedef struct {
+    uint8_t sw;
+    uint8_t portc;            // ROUTE_C_MASK bits
+    uint8_t portd;            // ROUTE_D_MASK bits
+} path_route_t;
+
+#define DIGIIF_MASK     (_BV(3) | _BV(2))
+
+static const path_route_t path_routes[] PROGMEM = {
+    { 0b000001, _BV(3),          _BV(0) },    // usb:   DAC, DIGIIF_SEL usb
+    { 0b000010, _BV(2),          _BV(0) },    // opt1:  DAC, DIGIIF_SEL opt1
+    { 0b000100, _BV(3) | _BV(2), _BV(0) },    // opt2:  DAC, DIGIIF_SEL opt2
+    { 0b001000, 0,               _BV(0) },    // opt3:  DAC, DIGIIF_SEL opt3
+    { 0b010000, _BV(5) | _BV(2), 0      },    // line1: SEL_AIN1
+    { 0b100000, _BV(1) | _BV(2), 0      },    // line2: SEL_AIN2
+    { 0,        _BV(2),          0      },    // none
+};
+
+static uint8_t path_muting = 0;
+static uint32_t path_mute_t0;
+
+/*
+    Lock statistics
+
+    For each digital input (usb, opt1..3) the time from selecting it, or
+    from a loss of lock, until DAC_ERROR (PC4) goes low is kept as
+    min/avg/max and a histogram of LOCK_BINS power-of-two bins starting
+    at 8ms (<8, <16, ... ms, the last bin open ended). Every loss is
+    logged, and every lock as one line with the input's totals; the
+    histogram follows as a second line on a later tick, once log_ring has
+    room for it, so neither waits on the soft UART inside tick_tasks().
+    A lock also resets idle_count: the gain comes back on the next tick
+    even with the pot idle, no fixed delay is involved.
+*/
+#define LOCK_INPUTS     4
+#define LOCK_BINS       8
+#define LOCK_NONE       0xff
+#define LOCK_HIST_LEN   48          // "HIST in=3 255,...\r\n" at most
+
+typedef struct {
+    uint16_t locks;
+    uint16_t losses;
+    uint16_t min_ms;
+    uint16_t max_ms;
+    uint32_t sum_ms;
+    uint8_t hist[LOCK_BINS];    // Saturating
+} lock_stat_t;
+
+static lock_stat_t lock_stat[LOCK_INPUTS];
+static uint8_t lock_in = LOCK_NONE;    // Input being timed
+static uint8_t lock_wait = 0;          // Waiting for PC4 to clear
+static uint8_t lock_hist = LOCK_NONE;  // Input whose histogram is due
+static uint32_t lock_t0;
+
+// Mute for a selector change; the first one starts the "PATH mute=" time
+void path_mute(void)
 {
+    if (!path_muting && (warm_state.line_gain || warm_state.hpa_gain)) {
+        path_mute_t0 = time_us();
+        path_muting = 1;
+    }
+    mute_all();
+}
+
+void path_select(uint8_t sw)
+{
+    const path_route_t *r = path_routes;
+    uint8_t c, d, dc, dd;
+
+    while (pgm_read_byte(&r->sw) && pgm_read_byte(&r->sw) != sw) {
+        r++;
+    }
+    c = pgm_read_byte(&r->portc);
+    d = pgm_read_byte(&r->portd);
 
-    uint8_t capture_sw;
+    if (d & _BV(0)) {
+        lock_in = r - path_routes;    // DAC input: time to lock
+        lock_wait = 1;
+        lock_t0 = time_us();
+    } else {
+        lock_in = LOCK_NONE;
+    }
 
-    capture_sw = (bit_is_clear(PIND,5))<<5 | (bit_is_clear(PINB,7))<<4 | (bit_is_clear(PINB,6))<<3 
-                | (bit_is_clear(PIND,4))<<2 | (bit_is_clear(PIND,3))<<1 | (bit_is_clear(PIND,2));
+    dc = (PORTC ^ c) & ROUTE_C_MASK;
+    dd = (PORTD ^ d) & ROUTE_D_MASK;
 
-    if (!((capture_sw == 0b000001) || (capture_sw == 0b000010) || (capture_sw == 0b000100) 
-        || (capture_sw == 0b001000) || (capture_sw == 0b010000) || (capture_sw == 0b100000))) {
+    idle_count = 0;        // Write the gain on the next tick
 
-        current_sel_sw_state = capture_sw;
-        return 1;
+    if (dd || (dc & ~DIGIIF_MASK) || (dc && (PORTD & _BV(0)))) {
+        path_mute();
+    }
+
+    if (dc) {
+        PORTC ^= dc;
+    }
+    if (dd) {
+        PORTD ^= dd;
     }
 
-    if (capture_sw != current_sel_sw_state) {
+    warm_state.sel_sw_state = sw;
+    warm_state.portc = PORTC & ROUTE_C_MASK;
+    warm_state.portd = PORTD & ROUTE_D_MASK;
+    warm_state_seal();
+}
 
-        current_sel_sw_state = capture_sw;
-        wait_ms(5);        // Wait: 5ms
+void path_proc(void)
+{
+    uint32_t t;
+
+    if (path_muting && (warm_state.line_gain || warm_state.hpa_gain)) {
+        path_muting = 0;
+        t = time_us() - path_mute_t0;
+        log_puts_P(PSTR("PATH mute="));
+        log_putu(t > 0xffff ? 0xffff : t);
+        log_puts_P(PSTR("us\r\n"));
+    }
+}
+
+void lock_report(uint8_t in, uint16_t ms)
+{
+    lock_stat_t *s = &lock_stat[in];
+
+    log_puts_P(PSTR("LOCK in="));
+    log_putu(in);
+    log_puts_P(PSTR(" ms="));
+    log_putu(ms);
+    log_puts_P(PSTR(" n="));
+    log_putu(s->locks);
+    log_puts_P(PSTR(" loss="));
+    log_putu(s->losses);
+    log_puts_P(PSTR(" min="));
+    log_putu(s->min_ms);
+    log_puts_P(PSTR(" avg="));
+    log_putu(s->locks ? s->sum_ms / s->locks : 0);
+    log_puts_P(PSTR(" max="));
+    log_putu(s->max_ms);
+    log_puts_P(PSTR("\r\n"));
+}
+
+void lock_hist_report(uint8_t in)
+{
+    lock_stat_t *s = &lock_stat[in];
+    uint8_t i;
+
+    log_puts_P(PSTR("HIST in="));
+    log_putu(in);
+    log_putc(' ');
+    for (i = 0; i < LOCK_BINS; i++) {
+        log_putu(s->hist[i]);
+        log_putc(i < LOCK_BINS - 1 ? ',' : '\r');
+    }
+    log_putc('\n');
+}
+
+void lock_proc(void)
+{
+    lock_stat_t *s;
+    uint16_t ms;
+    uint8_t bin;
 
+    if (lock_hist != LOCK_NONE && log_ring_free() >= LOCK_HIST_LEN) {
+        lock_hist_report(lock_hist);
+        lock_hist = LOCK_NONE;
+    }
+
+    if (lock_in == LOCK_NONE) {
+        return;
+    }
+    s = &lock_stat[lock_in];
 
-        if (capture_sw != ((bit_is_clear(PIND,5))<<5 | (bit_is_clear(PINB,7))<<4 | (bit_is_clear(PINB,6))<<3 
-                    | (bit_is_clear(PIND,4))<<2 | (bit_is_clear(PIND,3))<<1 | (bit_is_clear(PIND,2)))) {
+    if (lock_wait) {
 
-            current_sel_sw_state = capture_sw;
-            return 1;
+        if (bit_is_set(PINC, 4)) {
+            return;
         }
 
-        // Mute --------------------------------------------------------------------------------------------
-        PORTB &= ~_BV(1);    // CS2 -> 0
-        pga2311(0);
-        PORTB |= _BV(1);    // CS2 -> 1
+        ms = (time_us() - lock_t0) / 1000;
+        lock_wait = 0;
+        idle_count = 0;        // Unmute: write the gain on the next tick
+
+        if (s->locks == 0 || ms < s->min_ms) {
+            s->min_ms = ms;
+        }
+        if (ms > s->max_ms) {
+            s->max_ms = ms;
+        }
+        s->sum_ms += ms;
+        s->locks++;
 
-        PORTB &= ~_BV(2);    // CS1 -> 0
-        pga2311(0);
-        PORTB |= _BV(2);    // CS1 -> 1
+        for (bin = 0; bin < LOCK_BINS - 1 && ms >= (8U << bin); bin++)
+            ;
+        if (s->hist[bin] < 0xff) {
+            s->hist[bin]++;
+        }
 
-        idle_count = 0;        // idle_count Zbg
+        lock_report(lock_in, ms);
+        lock_hist = lock_in;
 
-        // Selector SW Set ---------------------------------------------------------------------------------
-        switch(current_sel_sw_state) {
-        
-            case 0b000001 :        // "usb"
-            
-                PORTD |= _BV(0);    //     Main Board: Select DAC Input
-                PORTC &= ~_BV(5);
-                PORTC &= ~_BV(1);
-                PORTC |= _BV(3);    //     DIGIIF_SEL: usb
-                PORTC &= ~_BV(2);
-                break;
-
-            case 0b000010 :        // "opt1"
-
-                PORTD |= _BV(0);    //     Main Board: Select DAC Input
-                PORTC &= ~_BV(5);
-                PORTC &= ~_BV(1);
-                PORTC &= ~_BV(3);    //     DIGIIF_SEL: opt1
-                PORTC |= _BV(2);
-                break;
-
-            case 0b000100 :        // "opt2"
-
-                PORTD |= _BV(0);    //     Main Board: Select DAC Input
-                PORTC &= ~_BV(5);
-                PORTC &= ~_BV(1);
-                PORTC |= _BV(3);    //    DIGIIF_SEL: opt2
-                PORTC |= _BV(2);
-                break;
-
-            case 0b001000 :        // "opt3"
-
-                PORTD |= _BV(0);    //     Main Board: Select DAC Input
-                PORTC &= ~_BV(5);
-                PORTC &= ~_BV(1);
-                PORTC &= ~_BV(3);    //     DIGIIF_SEL: opt3
-                PORTC &= ~_BV(2);
-                break;
-
-            case 0b010000 :        // "line1"
-
-                PORTD &= ~_BV(0);
-                PORTC |= _BV(5);    //     Main Board: Select Line1 Input
-                PORTC &= ~_BV(1);
-                PORTC &= ~_BV(3);    //     DIGIIF_SEL: opt1
-                PORTC |= _BV(2);
-                break;
-
-            case 0b100000 :        // "line2"
-            
-                PORTD &= ~_BV(0);
-                PORTC &= ~_BV(5);
-                PORTC |= _BV(1);    //     Main Board: Select Line2 Input
-                PORTC &= ~_BV(3);    //     DIGIIF_SEL: opt1
-                PORTC |= _BV(2);
-                break;
-
-            default :
-
-                PORTD &= ~_BV(0);
-                PORTC &= ~_BV(5);
-                PORTC &= ~_BV(1);
-                PORTC &= ~_BV(3);    //     DIGIIF_SEL: opt1
-                PORTC |= _BV(2);
-                break;
+    } else if (bit_is_set(PINC, 4)) {
+
+        s->losses++;
+        lock_wait = 1;
+        lock_t0 = time_us();
+
+        log_puts_P(PSTR("UNLOCK\r\n"));
+    }
+}
+
+
+uint8_t sel_sw_read(void)
+{
+    return (bit_is_clear(PIND,5))<<5 | (bit_is_clear(PINB,7))<<4 | (bit_is_clear(PINB,6))<<3 
+         | (bit_is_clear(PIND,4))<<2 | (bit_is_clear(PIND,3))<<1 | (bit_is_clear(PIND,2));
+}
+
+
+uint8_t sel_sw_valid(uint8_t sw)
+{
+    return (sw == 0b000001) || (sw == 0b000010) || (sw == 0b000100) 
+        || (sw == 0b001000) || (sw == 0b010000) || (sw == 0b100000);
+}
+
+
+// Selector change: debounce SEL_DEBOUNCE ticks, then switch the route
+PT_THREAD(selector_thread(pt_t *pt))
+{
+
+    static uint8_t capture_sw;
+    static uint8_t t0;
+
+    PT_BEGIN(pt);
+
+    while (1) {
+
+        PT_WAIT_UNTIL(pt, (capture_sw = sel_sw_read()) != current_sel_sw_state);
+
+        current_sel_sw_state = capture_sw;
+
+        if (!sel_sw_valid(capture_sw)) {
+            continue;
         }
+
+        sel_pending = 1;
+        t0 = tick_done;
+        PT_WAIT_UNTIL(pt, (uint8_t) (tick_done - t0) >= SEL_DEBOUNCE);
+        sel_pending = 0;
+
+        if (capture_sw != sel_sw_read()) {
+            continue;
+        }
+
+        path_select(current_sel_sw_state);
+
+        log_puts_P(PSTR("SEL "));
+        log_putu(current_sel_sw_state);
+        log_puts_P(PSTR("\r\n"));
     }
 
+    PT_END(pt);
+}
+
+
+uint8_t selector_proc(void)
+{
+
+    selector_thread(&pt_selector);
 
-//    wait_ms(2);        // Wait: 2ms
+    if (!sel_sw_valid(current_sel_sw_state) || sel_pending) {
+        return 1;
+    }
 
     // LED, "INPUT ENABLE"
     if ((current_sel_sw_state == 0b100000) || (current_sel_sw_state == 0b010000) || (bit_is_clear(PINC,4))) {
@@ -256,6 +1034,61 @@ uint8_t selector_proc(void)
 
 
 
+uint8_t jack_proc(void)
+{
+    uint8_t level;
+
+    level = bit_is_set(PINB, HP_DET) ? 1 : 0;
+    if (level != jack_level) {
+        jack_level = level;
+        jack_stable = 0;
+    }
+
+    if (jack_stable < HP_DEBOUNCE) {
+        jack_stable++;
+        return hp_active;    // Not settled yet, keep the current output
+    }
+
+    return !jack_level;
+}
+
+
+uint8_t output_proc(void)
+{
+    uint8_t gain;
+
+    if (jack_proc() == hp_active) return 0;
+
+    // Fade the active output out, then hand over
+    if (hp_active) {
+
+        gain = (warm_state.hpa_gain > HP_RAMP_STEP) ? warm_state.hpa_gain - HP_RAMP_STEP : 0;
+
+        pga2311_write(PGA_HPA, gain);
+
+    } else {
+
+        gain = (warm_state.line_gain > HP_RAMP_STEP) ? warm_state.line_gain - HP_RAMP_STEP : 0;
+
+        pga2311_write(PGA_LINE, gain);
+
+    }
+
+    // Write the gain on the next tick: the new output once the fade is
+    // done, or the old one back if the jack flips back mid-fade
+    idle_count = 0;
+
+    if (gain == 0) {
+        hp_active = !hp_active;
+    }
+
+    warm_state_seal();
+
+    return 1;
+}
+
+
+
 void attenuation_proc(void)
 {
 
@@ -277,7 +1110,7 @@ void attenuation_proc(void)
 
 
         // OlƂ̔r
-        if (abs((int16_t) current_trim1 - (int16_t) ADCH) > 2) {
+        if (abs((int16_t) current_trim1 - (int16_t) ADCH) > ADC_HYST) {
             idle_count = 0;        // idle_count Zbg
         }
 
@@ -299,7 +1132,7 @@ void attenuation_proc(void)
         while(ADCSRA & _BV(ADSC));
 
         // OlƂ̔r
-        if (abs((int16_t) current_trim2 - (int16_t) ADCH) > 2) {
+        if (abs((int16_t) current_trim2 - (int16_t) ADCH) > ADC_HYST) {
             idle_count = 0;        // idle_count Zbg
         }
 
@@ -320,10 +1153,10 @@ void attenuation_proc(void)
 
 
     // OlƂ̔r
-    if (abs((int16_t) current_volume - (int16_t) ADCH) > 2) {
+    if (abs((int16_t) current_volume - (int16_t) ADCH) > ADC_HYST) {
         idle_count = 0;        // idle_count Zbg
 
-    } else if (idle_count < 200) {
+    } else if (idle_count < IDLE_TICKS) {
         idle_count++;
 
     } else {
@@ -336,75 +1169,267 @@ void attenuation_proc(void)
     // Selector SW: Line1
     if (current_sel_sw_state == 0b010000) {
 
-        main_volume = att_value[current_volume] + (current_trim1 >>3);
-        line_trim = 188 + (current_trim1 >>3);
+        main_volume = att_value[current_volume] + (current_trim1 >> TRIM_SHIFT);
+        line_trim = 188 + (current_trim1 >> TRIM_SHIFT);
 
     // Selector SW: Line2
     } else if (current_sel_sw_state == 0b100000) {
 
-        main_volume = att_value[current_volume] + (current_trim2 >>3);
-        line_trim = 188 + (current_trim2 >>3);
+        main_volume = att_value[current_volume] + (current_trim2 >> TRIM_SHIFT);
+        line_trim = 188 + (current_trim2 >> TRIM_SHIFT);
 
     // Selector SW: Others
     } else {
 
         main_volume = att_value[current_volume] + 16;
-        line_trim = 204 + (current_trim2 >>3);
+        line_trim = 204 + (current_trim2 >> TRIM_SHIFT);
+
+    }
+
+    if (hp_active) {
+
+        // wbhzAv {[
+        pga2311_write(PGA_HPA, main_volume);
+
+    } else {
+
+        // Co {[
+        pga2311_write(PGA_LINE, line_trim);
 
     }
 
-    // wbhzAv {[
-    PORTB &= ~_BV(2);    // CS1 -> 0
-    pga2311(main_volume);
-    PORTB |= _BV(2);    // CS1 -> 1
+    warm_state_seal();
 
-    // Co {[
-    PORTB &= ~_BV(1);    // CS2 -> 0
-    pga2311(line_trim);
-    PORTB |= _BV(1);    // CS2 -> 1
+}
+
+
+
+// Cold start: 500ms for the supplies to settle, then close the relay
+PT_THREAD(powerup_thread(pt_t *pt))
+{
+
+    static uint32_t deadline;
+#ifdef PGA_READBACK
+    static spical_t cal;
+    static uint8_t dev;
+#endif
+
+    PT_BEGIN(pt);
+
+    deadline = time_us() + 500000UL;
+    PT_WAIT_UNTIL(pt, time_reached(deadline));    // Wait: 500ms
+
+#ifdef PGA_READBACK
+    // Relay still open. One round per tick: spical_init() for both
+    // devices would run past the watchdog timeout.
+    for (dev = 0; dev < 2; dev++) {
+        spical_start(&cal, dev, EE_SPICAL + 2 * dev);
+        PT_WAIT_UNTIL(pt, spical_step(&cal));
+        pga_dly[dev] = spi_dly;
+    }
+    pga2311_write(PGA_LINE, 0);
+    pga2311_write(PGA_HPA, 0);
+#endif
+
+    relay_on();        // Output relay
+
+    PT_END(pt);
+}
+
+
+// Selector parked off every position: mute, open the relay, and close it
+// again once the selector is back. The outputs stay muted while this runs.
+PT_THREAD(relay_release_thread(pt_t *pt))
+{
+
+    static uint8_t t0;
+
+    PT_BEGIN(pt);
 
+    t0 = tick_done;
+    PT_WAIT_UNTIL(pt, sel_sw_valid(current_sel_sw_state)
+                      || (uint8_t) (tick_done - t0) >= RELAY_OFF_MS / 5);
+    if (sel_sw_valid(current_sel_sw_state)) {
+        PT_EXIT(pt);    // Only passing between positions
+    }
+
+    mute_all();
+    t0 = tick_done;
+    PT_WAIT_UNTIL(pt, (uint8_t) (tick_done - t0) >= RELAY_MUTE_MS / 5);
+    relay_off();
+
+    PT_WAIT_UNTIL(pt, sel_sw_valid(current_sel_sw_state));
+    relay_on();
+    PT_WAIT_UNTIL(pt, relay_pullin == 0);
+
+    PT_END(pt);
 }
 
 
+void tick_tasks(void)
+{
+    uint8_t muted;
+
+    if (powerup) {
+
+        // Selector and volume start once the relay is closed
+        mute_all();
+        if (!PT_SCHEDULE(powerup_thread(&pt_powerup))) {
+            powerup = 0;
+        }
+
+    } else {
+
+        relay_proc();
+
+        muted = selector_proc();
+
+        if (relay_releasing || !sel_sw_valid(current_sel_sw_state)) {
+            relay_releasing = PT_SCHEDULE(relay_release_thread(&pt_relay));
+            if (!relay_releasing) {
+                PT_INIT(&pt_relay);
+            }
+        }
+
+        if (muted || relay_releasing) {
+            path_mute();
+        }else{
+            if (output_proc() == 0) {
+                attenuation_proc();
+            }
+            pga2311_recheck();
+        }
+
+        path_proc();
+        lock_proc();
+
+    }
+
+    task_checkin |= TASK_TICK;    // Watchdog check-in
+
+}
+
 
 ISR (TIMER1_COMPA_vect) {
 //C:\WinAVR-20090313\avr\include\avr\iom8.h
 
-    if (selector_proc() == 1) {
+    time_base += 5000;
+    tick++;
 
-        cli();    // 荞݋֎~
+}
 
-        // Mute
-        PORTB &= ~_BV(1);    // CS2 -> 0
-        pga2311(0);
-        PORTB |= _BV(1);    // CS2 -> 1
 
-        PORTB &= ~_BV(2);    // CS1 -> 0
-        pga2311(0);
-        PORTB |= _BV(2);    // CS1 -> 1
+ISR (TIMER2_OVF_vect) {
 
-        sei();    // 荞݋
+    PORTD |= _BV(6);    // Relay hold PWM: on
 
-    }else{
+}
 
-        cli();    // 荞݋֎~
-        attenuation_proc();
-        sei();    // 荞݋
 
-    }
+ISR (TIMER2_COMP_vect) {
+
+    PORTD &= ~_BV(6);    // Relay hold PWM: off
 
 }
 
 
 int main(void) {
 
-    init_devices();
+    uint16_t free, reported_free;
+    uint8_t stack_tick = 0;
+
+    if ((reset_cause & _BV(WDRF)) && warm_state_valid()) {
+        warm_state.wdt_resets++;
+        init_devices(1);    // Warm restart
+    } else {
+        init_devices(0);
+    }
+
+    log_puts_P(PSTR("RESET cause="));
+    log_putu(reset_cause);
+    log_puts_P(PSTR(" wdt="));
+    log_putu(warm_state.wdt_resets);
+    log_puts_P(PSTR("\r\n"));
+    log_flush();    // One line at a time through log_ring
+
+    reported_free = stack_free();
+    ram_report(reported_free);
+    log_flush();
+
+#ifdef RINGBUF_BENCH
+    ringbuf_bench();
+#endif
+
+    log_flush();
+
+    wdt_enable(WDT_TIMEOUT);
 
     //     ݒ
     SREG |= _BV(7);    // S
 
     sei();    // 荞݋
 
-    while(1);    // [v
+    PT_INIT(&pt_selector);
+    PT_INIT(&pt_powerup);
+
+    set_sleep_mode(SLEEP_MODE_IDLE);    // Timers keep running
+
+    while(1) {    // [v
+
+        // Watchdog: kick only when every task has checked in
+        cli();
+        task_checkin |= TASK_MAIN;
+        if (task_checkin == TASK_ALL) {
+            wdt_reset();
+            task_checkin = 0;
+        }
+        sei();
+
+        // Stack high-water mark
+        if ((uint8_t) (tick_done - stack_tick) >= STACK_CHECK_TICKS) {
+            stack_tick = tick_done;
+            free = stack_free();
+            if (free < reported_free) {
+                reported_free = free;
+                ram_report(free);
+            }
+        }
+
+        // Per-tick work, catching up on any tick missed. A calibration
+        // round at power-up can outlast a tick; the ticks it covered are
+        // dropped, so the watchdog check-in above still comes round.
+        if (powerup && tick != tick_done) {
+            tick_done = tick - 1;
+        }
+        while (tick != tick_done) {
+            uint32_t t0 = time_us();
+            uint16_t t;
+
+            tick_done++;
+            tick_tasks();
+
+            t = time_us() - t0;
+            if (t > tick_us_max) {
+                tick_us_max = t;
+                log_puts_P(PSTR("TICK max="));
+                log_putu(t);
+                log_puts_P(PSTR("us\r\n"));
+            }
+        }
+
+        log_flush();
+
+        // Sleep until the next interrupt (tick, relay PWM). Checked
+        // with interrupts off; sei() takes effect after sleep_cpu().
+        cli();
+        if (tick == tick_done && log_ring_count() == 0) {
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+        }
+        sei();
+
+    }
 
 }
\ No newline at end of file
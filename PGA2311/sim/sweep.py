@@ -0,0 +1,322 @@
+#!/usr/bin/env python3
+"""
+Parameter sweep for the PGA2311 control loop tuning constants on simulavr
+
+Builds PGA2311_avr.c once per combination of the tuning constants (-D, see
+"Control loop tuning" in the source), runs every build over every trace in
+the trace library on a simulated ATmega8 (pysimulavr, the simulavr Python
+binding), one run per process across all cores, and reports per
+combination
+
+    lat avg/max   ms from each intended action to the first response
+                  (route pins for SEL, a changed gain write otherwise)
+    missed        intended actions without a response within --window ms
+    redundant     PGA2311 writes repeating the last value sent to that device
+    false         route changes and gain changes no intended action explains
+
+    sweep.py [-g ADC_HYST=1,2,4 -g SEL_DEBOUNCE=1,2,4 ...] [-j N]
+             [--traces DIR] [--window 500] [--csv out.csv]
+
+Constants not given with -g keep their default. PGA2311 writes are decoded
+from CS/SCLK/SDI, so the firmware runs unchanged; only its four blank
+#include lines (the header names are missing in the source) are filled in
+for the build.
+
+Trace format, one event per line, times in ms from reset:
+
+    <ms> VOLUME|TRIM1|TRIM2 <0..255>    pot position, as ADCH reads it
+    <ms> SEL usb|opt1|opt2|opt3|line1|line2|none
+    <ms> HP 0|1                         HP_DETECT level (0: plugged)
+    <ms> LOCK 0|1                       1: DAC locked (DAC_ERROR low)
+    <ms> noise <pot> <amp> <every> <until>
+                                        +-amp around the pot position,
+                                        every ms until <until>
+    <ms> intent <signal> <value>        the action the user meant; the
+                                        events around it are bounce/noise
+    <ms> end
+
+The noise is seeded from the trace name, so runs repeat exactly.
+
+simulavr steps every clock cycle, sleep included: the firmware sleeping
+between ticks does not make a run faster, and there is no fast-forward to
+the next event. A trace costs about its own length in simulated cycles, so
+keep traces to seconds, not hours.
+"""
+
+import argparse
+import csv
+import itertools
+import multiprocessing
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.join(HERE, "..", "PGA2311_avr.c")
+TRACES = os.path.join(HERE, "traces")
+
+MCU = "atmega8"
+CLOCK_NS = 1000                 # 1MHz
+VCC = 5.0
+HEADERS = ("avr/io.h", "avr/interrupt.h", "util/delay.h", "stdlib.h")
+
+DEFAULTS = {"ADC_HYST": 2, "IDLE_TICKS": 200, "SEL_DEBOUNCE": 1,
+            "TRIM_SHIFT": 3, "HP_DEBOUNCE": 4}
+GRID = {"ADC_HYST": [1, 2, 3, 4], "IDLE_TICKS": [50, 100, 200],
+        "SEL_DEBOUNCE": [1, 2, 4], "TRIM_SHIFT": [3]}
+
+SEL_PINS = {"usb": "D2", "opt1": "D3", "opt2": "D4",
+            "opt3": "B6", "line1": "B7", "line2": "D5"}
+POT_PINS = {"VOLUME": "ADC6", "TRIM1": "ADC7", "TRIM2": "C0"}
+ROUTE_PINS = ("C1", "C2", "C3", "C5", "D0")
+CS_PINS = {"B1": "line", "B2": "hpa"}
+SETTLE_MS = 1000                # Cold power-up, not scored
+
+
+# --- build ---------------------------------------------------------------
+
+def build(params, workdir, cc="avr-gcc"):
+    src = os.path.join(workdir, "pga2311.c")
+    if not os.path.exists(src):
+        with open(SOURCE, "rb") as f:
+            text = re.sub(rb"(?m)^#include\s*$", b"", f.read())
+        with open(src, "wb") as f:
+            f.write(text)
+    name = "_".join("%s%d" % (k.lower(), v) for k, v in sorted(params.items()))
+    out = os.path.join(workdir, name + ".elf")
+    cmd = [cc, "-mmcu=" + MCU, "-DF_CPU=1.000E6", "-Os", "-std=gnu99",
+           "-I" + os.path.join(HERE, "..")]
+    for h in HEADERS:
+        cmd += ["-include", h]
+    cmd += ["-D%s=%d" % kv for kv in sorted(params.items())]
+    subprocess.check_call(cmd + ["-o", out, src])
+    return out
+
+
+# --- traces --------------------------------------------------------------
+
+def load_trace(path):
+    events, intents = [], []
+    end = 0
+    noise = []
+    with open(path) as f:
+        for line in f:
+            line = line.split("#", 1)[0].split()
+            if not line:
+                continue
+            t, what, args = int(line[0]), line[1], line[2:]
+            if what == "end":
+                end = t
+            elif what == "intent":
+                intents.append((t, args[0], args[1]))
+            elif what == "noise":
+                noise.append((t, args[0], int(args[1]), int(args[2]), int(args[3])))
+            else:
+                events.append((t, what, args[0]))
+    rnd = random.Random(os.path.basename(path))
+    for t0, pot, amp, every, until in noise:
+        for t in range(t0, until, every):
+            base = [int(v) for te, s, v in events if s == pot and te <= t]
+            if base:
+                v = min(255, max(0, base[-1] + rnd.randint(-amp, amp)))
+                events.append((t, pot + "~", str(v)))   # Does not move the base
+        base = [v for te, s, v in events if s == pot and te <= until]
+        if base:
+            events.append((until, pot + "~", base[-1]))
+    events.sort(key=lambda e: e[0])
+    return events, intents, end or (events[-1][0] + 1000)
+
+
+# --- one simulation run (own process) ------------------------------------
+
+def simulate(elf, events, end_ms):
+    import pysimulavr
+
+    pysimulavr.DumpManager.Instance().SetSingleDeviceApp()
+    sc = pysimulavr.SystemClock.Instance()
+    dev = pysimulavr.AvrFactory.instance().makeDevice(MCU)
+    dev.Load(elf)
+    dev.SetClockFreq(CLOCK_NS)
+    sc.Add(dev)
+
+    writes = []                 # (ns, device, 16-bit word)
+    routes = []                 # (ns, route pin levels)
+    level = {}
+    spi = {"cs": None, "bits": 0, "n": 0}
+    keep = []
+
+    def now():
+        return sc.GetCurrentTime()
+
+    def on_change(name, high):
+        level[name] = high
+        if name in CS_PINS:
+            if not high:
+                spi.update(cs=CS_PINS[name], bits=0, n=0)
+            elif spi["cs"] == CS_PINS[name]:
+                if spi["n"] == 16:
+                    writes.append((now(), spi["cs"], spi["bits"]))
+                spi["cs"] = None
+        elif name == "D7" and high and spi["cs"]:
+            spi["bits"] = (spi["bits"] << 1 | level.get("B0", 0)) & 0xffff
+            spi["n"] += 1
+        elif name in ROUTE_PINS:
+            routes.append((now(), tuple(level.get(p, 0) for p in ROUTE_PINS)))
+
+    class Probe(pysimulavr.Pin):
+        def __init__(self, name):
+            pysimulavr.Pin.__init__(self)
+            self.name = name
+
+        def SetInState(self, pin):
+            pysimulavr.Pin.SetInState(self, pin)
+            on_change(self.name, pin.toChar() in "Hh1")
+
+    def wire(dev_pin, pin):
+        net = pysimulavr.Net()
+        net.Add(dev.GetPin(dev_pin))
+        net.Add(pin)
+        keep.append((net, pin))
+        return pin
+
+    for name in tuple(CS_PINS) + ("D7", "B0") + ROUTE_PINS:
+        wire(name, Probe(name))
+
+    drive = {}
+    for name in tuple(SEL_PINS.values()) + ("B5", "C4") + tuple(POT_PINS.values()):
+        drive[name] = wire(name, pysimulavr.Pin())
+    for name in SEL_PINS.values():
+        drive[name].SetPin("H")
+    drive["B5"].SetPin("H")     # No headphone
+    drive["C4"].SetPin("H")     # Not locked
+    for name in POT_PINS.values():
+        drive[name].SetAnalogValue(0.0)
+
+    for t, what, value in events + [(end_ms, "end", "")]:
+        sc.RunTimeRange(max(0, t * 1000000 - now()))
+        if what == "SEL":
+            for sw, name in SEL_PINS.items():
+                drive[name].SetPin("L" if sw == value else "H")
+        elif what == "HP":
+            drive["B5"].SetPin("H" if value == "1" else "L")
+        elif what == "LOCK":
+            drive["C4"].SetPin("L" if value == "1" else "H")
+        elif what.rstrip("~") in POT_PINS:
+            drive[POT_PINS[what.rstrip("~")]].SetAnalogValue(int(value) / 256.0 * VCC)
+
+    return ([(t / 1e6, d, w) for t, d, w in writes],
+            [(t / 1e6, r) for t, r in routes])
+
+
+# --- scoring -------------------------------------------------------------
+
+def score(intents, writes, routes, window):
+    changes, last = [], {}
+    redundant = 0
+    for t, d, w in writes:
+        if last.get(d) == w:
+            redundant += 1
+        else:
+            changes.append(t)
+        last[d] = w
+
+    route_t, prev = [], None
+    for t, r in routes:
+        if r != prev and (not route_t or t - route_t[-1] > 1):
+            route_t.append(t)       # Pins of one port write land together
+        prev = r
+
+    lat, missed, explained = [], 0, set()
+    for t0, sig, _ in intents:
+        pool = route_t if sig == "SEL" else changes
+        hit = [t for t in pool if t0 <= t <= t0 + window]
+        if hit:
+            lat.append(hit[0] - t0)
+        else:
+            missed += 1
+        explained.update(("r" if sig == "SEL" else "g", t) for t in hit)
+        if sig == "SEL":            # Mute and restore around a route change
+            explained.update(("g", t) for t in changes if t0 <= t <= t0 + window)
+
+    false = sum(1 for t in route_t if t >= SETTLE_MS and ("r", t) not in explained)
+    false += sum(1 for t in changes if t >= SETTLE_MS and ("g", t) not in explained)
+    return lat, missed, redundant, false
+
+
+def job(args):
+    elf, trace, window = args
+    events, intents, end = load_trace(trace)
+    writes, routes = simulate(elf, events, end)
+    return score(intents, writes, routes, window)
+
+
+# --- sweep ---------------------------------------------------------------
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0].strip())
+    ap.add_argument("-g", action="append", default=[], metavar="NAME=V1,V2",
+                    help="grid for one constant (default grid when none given)")
+    ap.add_argument("-j", type=int, default=os.cpu_count() or 4)
+    ap.add_argument("--traces", default=TRACES)
+    ap.add_argument("--window", type=int, default=500, help="ms an action may take")
+    ap.add_argument("--csv")
+    ap.add_argument("--cc", default="avr-gcc")
+    args = ap.parse_args()
+
+    grid = dict(GRID)
+    if args.g:
+        grid = {}
+        for g in args.g:
+            k, v = g.split("=", 1)
+            if k not in DEFAULTS:
+                sys.exit("unknown constant " + k)
+            grid[k] = [int(x) for x in v.split(",")]
+    names = sorted(DEFAULTS)
+    combos = []
+    for values in itertools.product(*grid.values()):
+        p = dict(DEFAULTS)
+        p.update(zip(grid.keys(), values))
+        combos.append(p)
+
+    traces = sorted(os.path.join(args.traces, f) for f in os.listdir(args.traces)
+                    if f.endswith(".trace"))
+    if not traces:
+        sys.exit("no traces in " + args.traces)
+
+    with tempfile.TemporaryDirectory() as workdir:
+        with multiprocessing.Pool(args.j) as pool:
+            elfs = pool.starmap(build, [(p, workdir, args.cc) for p in combos])
+        # Fresh process per run: the simulavr clock is a per-process singleton
+        with multiprocessing.Pool(args.j, maxtasksperchild=1) as pool:
+            runs = pool.map(job, [(e, t, args.window) for e in elfs for t in traces],
+                            chunksize=1)
+
+    rows = []
+    for i, p in enumerate(combos):
+        lat, missed, redundant, false = [], 0, 0, 0
+        for l, m, r, f in runs[i * len(traces):(i + 1) * len(traces)]:
+            lat += l
+            missed += m
+            redundant += r
+            false += f
+        rows.append([p[k] for k in names] + [
+            round(sum(lat) / len(lat), 1) if lat else "-",
+            round(max(lat), 1) if lat else "-", missed, redundant, false])
+    rows.sort(key=lambda r: (r[-1], r[-3], r[-5] if r[-5] != "-" else 1e9, r[-2]))
+
+    head = names + ["lat_avg", "lat_max", "missed", "redundant", "false"]
+    print(" ".join("%12s" % h for h in head))
+    for r in rows:
+        print(" ".join("%12s" % v for v in r))
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            w = csv.writer(f)
+            w.writerow(head)
+            w.writerows(rows)
+
+
+if __name__ == "__main__":
+    main()
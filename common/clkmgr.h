@@ -0,0 +1,70 @@
+#ifndef CLKMGR_H
+#define CLKMGR_H
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/*
+    Dynamic CPU clock scaling (parts with CLKPR)
+
+    clk_fast() runs the core at F_CPU for SPI/bit-bang bursts, ADC work and
+    anything timed with _delay_us()/_delay_ms(); clk_idle() drops to
+    F_CPU >> CLK_IDLE_SHIFT while waiting. Both are cheap when the clock is
+    already where it should be.
+
+    The application provides
+
+        static void clk_retune(uint8_t from, uint8_t to);
+
+    which is called right after each switch, with interrupts disabled, to
+    rescale its timer compare values and baud rate from F_CPU >> from to
+    F_CPU >> to.
+
+    On parts without CLKPR (ATmega8) clk_fast()/clk_idle() compile to
+    nothing and clk_retune() is never called.
+*/
+
+#ifndef CLK_IDLE_SHIFT
+#define CLK_IDLE_SHIFT  3        // F_CPU / 8
+#endif
+
+#if defined(CLKPR)
+
+static uint8_t clk_shift = 0;    // Current CLKPR prescaler exponent
+
+static void clk_retune(uint8_t from, uint8_t to);
+
+static inline void clk_set(uint8_t shift)
+{
+    uint8_t from, sreg;
+
+    if (shift == clk_shift) return;
+
+    sreg = SREG;
+    cli();
+
+    CLKPR = _BV(CLKPCE);    // Timed sequence: 4 cycles
+    CLKPR = shift;
+
+    from = clk_shift;
+    clk_shift = shift;
+    clk_retune(from, shift);
+
+    SREG = sreg;
+}
+
+#else
+
+#define clk_shift       0
+
+static inline void clk_set(uint8_t shift)
+{
+    (void) shift;
+}
+
+#endif
+
+#define clk_fast()      clk_set(0)
+#define clk_idle()      clk_set(CLK_IDLE_SHIFT)
+
+#endif
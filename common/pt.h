@@ -0,0 +1,72 @@
+#ifndef PT_H
+#define PT_H
+
+#include <stdint.h>
+
+/*
+    Protothreads: stackless coroutines for sequencing
+
+    A sequence is a function written top to bottom; PT_WAIT_UNTIL() and
+    PT_YIELD() return to the caller and the next call resumes right after
+    them. The only state kept is the resume point, a pt_t of two bytes;
+    locals that must survive a wait have to be static. No switch() may
+    span a wait, since the resume point is itself a case label.
+
+        static pt_t pt_seq;
+
+        static PT_THREAD(seq(pt_t *pt))
+        {
+            static uint8_t t0;
+
+            PT_BEGIN(pt);
+            mute();
+            t0 = tick;
+            PT_WAIT_UNTIL(pt, (uint8_t) (tick - t0) >= 2);
+            route();
+            PT_END(pt);
+        }
+
+    Call it from the scheduler loop (every tick, or whenever its condition
+    may have changed) with PT_SCHEDULE(seq(&pt_seq)), which is true while
+    the sequence is still running. A finished sequence stays finished and
+    returns PT_ENDED until PT_INIT() starts it over.
+*/
+
+typedef struct {
+    uint16_t lc;
+} pt_t;
+
+#define PT_WAITING      0
+#define PT_YIELDED      1
+#define PT_ENDED        2
+
+#define PT_THREAD(decl) uint8_t decl
+
+#define PT_INIT(pt)     ((pt)->lc = 0)
+
+#define PT_BEGIN(pt)    { uint8_t pt_yield = 1; (void) pt_yield; switch ((pt)->lc) { case 0:
+
+#define PT_END(pt)      (pt)->lc = __LINE__; case __LINE__: ; } return PT_ENDED; }
+
+#define PT_WAIT_UNTIL(pt, cond)                                 \
+    do {                                                        \
+        (pt)->lc = __LINE__; case __LINE__:                     \
+        if (!(cond)) return PT_WAITING;                         \
+    } while (0)
+
+#define PT_WAIT_WHILE(pt, cond)     PT_WAIT_UNTIL(pt, !(cond))
+
+#define PT_YIELD(pt)                                            \
+    do {                                                        \
+        pt_yield = 0;                                           \
+        (pt)->lc = __LINE__; case __LINE__:                     \
+        if (!pt_yield) return PT_YIELDED;                       \
+    } while (0)
+
+#define PT_RESTART(pt)  do { PT_INIT(pt); return PT_WAITING; } while (0)
+
+#define PT_EXIT(pt)     do { (pt)->lc = 0xffff; return PT_ENDED; } while (0)
+
+#define PT_SCHEDULE(f)  ((f) < PT_ENDED)
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stdint.h>
+
+/*
+    Single-producer / single-consumer ring buffer for ISR <-> main handoff
+
+    RINGBUF(name, type, size) declares a static ring of `size` elements of
+    `type` and the inline functions
+
+        uint8_t name_put(type v)      1: stored, 0: full     (producer side)
+        uint8_t name_get(type *v)     1: fetched, 0: empty   (consumer side)
+        uint8_t name_count(void)      elements waiting
+        uint8_t name_free(void)       elements that can still be stored
+
+    `size` must be a power of two, 2..128. head/tail are free-running 8-bit
+    counters, so every index access is a single byte load/store and needs no
+    cli(): the producer only writes head, the consumer only writes tail, and
+    the element is stored (or read) before the index that publishes it.
+    Only multi-byte bookkeeping kept outside the ring (e.g. 16-bit drop
+    counters read from the other side) needs an ATOMIC_BLOCK.
+
+    Build PGA2311_avr.c with -DRINGBUF_BENCH to get the cycles per put/get
+    reported over its debug UART.
+*/
+
+#define RINGBUF_BARRIER()    __asm__ __volatile__ ("" ::: "memory")
+
+#define RINGBUF(name, type, size)                                                    \
+                                                                                     \
+typedef char name##_size_check[(((size) & ((size) - 1)) == 0 && (size) >= 2 && (size) <= 128) ? 1 : -1]; \
+                                                                                     \
+static struct {                                                                      \
+    type buf[size];                                                                  \
+    volatile uint8_t head;                                                           \
+    volatile uint8_t tail;                                                           \
+} name;                                                                              \
+                                                                                     \
+static inline uint8_t name##_put(type v)                                             \
+{                                                                                    \
+    uint8_t h = name.head;                                                           \
+                                                                                     \
+    if ((uint8_t) (h - name.tail) == (size)) return 0;                               \
+                                                                                     \
+    name.buf[h & ((size) - 1)] = v;                                                  \
+    RINGBUF_BARRIER();                                                               \
+    name.head = h + 1;                                                               \
+    return 1;                                                                        \
+}                                                                                    \
+                                                                                     \
+static inline uint8_t name##_get(type *v)                                            \
+{                                                                                    \
+    uint8_t t = name.tail;                                                           \
+                                                                                     \
+    if (t == name.head) return 0;                                                    \
+                                                                                     \
+    *v = name.buf[t & ((size) - 1)];                                                 \
+    RINGBUF_BARRIER();                                                               \
+    name.tail = t + 1;                                                               \
+    return 1;                                                                        \
+}                                                                                    \
+                                                                                     \
+static inline uint8_t name##_count(void)                                             \
+{                                                                                    \
+    return (uint8_t) (name.head - name.tail);                                        \
+}                                                                                    \
+                                                                                     \
+static inline uint8_t name##_free(void)                                              \
+{                                                                                    \
+    return (size) - (uint8_t) (name.head - name.tail);                               \
+}
+
+#endif
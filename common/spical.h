@@ -0,0 +1,149 @@
+#ifndef SPICAL_H
+#define SPICAL_H
+
+#include <stdint.h>
+#include <avr/eeprom.h>
+#include <util/delay_basic.h>
+
+/*
+    SPI clock self-calibration
+
+    The USI / bit-bang loops call SPICAL_HALF() after every clock edge;
+    spi_dly stretches each half period by 3 * spi_dly CPU cycles (0 = as
+    fast as the loop goes). spical_init() finds the shortest delay a device
+    passes read-back patterns at, backs off one step when the step below it
+    failed, and keeps the result in EEPROM as { dly, ~dly }.
+
+    The application provides
+
+        static uint8_t spical_test(uint8_t dev);
+
+    which runs its write/read-back patterns for device `dev` at the current
+    spi_dly and returns 1 when every one came back intact. On the next boot
+    the stored value is checked with one SPICAL_PASSES round and only
+    recalibrated when that fails (or the EEPROM record is blank/corrupt).
+*/
+
+#ifndef SPICAL_PASSES
+#define SPICAL_PASSES   16       // Rounds a step has to pass
+#endif
+
+#define SPICAL_NSTEPS   9
+#define SPICAL_SLOWEST  128
+
+static const uint8_t spical_steps[SPICAL_NSTEPS] = { 0, 1, 2, 4, 8, 16, 32, 64, SPICAL_SLOWEST };
+
+static uint8_t spi_dly = SPICAL_SLOWEST;    // Half-period stretch in use
+
+#define SPICAL_HALF()   do { if (spi_dly) _delay_loop_1(spi_dly); } while (0)
+
+static uint8_t spical_test(uint8_t dev);
+
+static inline uint8_t spical_pass(uint8_t dev)
+{
+    uint8_t n;
+
+    for (n = 0; n < SPICAL_PASSES; n++) {
+        if (!spical_test(dev)) return 0;
+    }
+    return 1;
+}
+
+// Stored delay without running any pattern (SPICAL_SLOWEST when there is none)
+static inline uint8_t spical_load(uint8_t *ee)
+{
+    uint8_t dly = eeprom_read_byte(ee);
+
+    return ((uint8_t) ~dly == eeprom_read_byte(ee + 1)) ? dly : SPICAL_SLOWEST;
+}
+
+// EEPROM record at ee[0..1]; returns the delay for `dev` and leaves it in spi_dly
+static inline uint8_t spical_init(uint8_t dev, uint8_t *ee)
+{
+    uint8_t dly = eeprom_read_byte(ee);
+    uint8_t i;
+
+    if ((uint8_t) ~dly == eeprom_read_byte(ee + 1)) {
+        spi_dly = dly;
+        if (spical_pass(dev)) return dly;
+    }
+
+    for (i = 0; i < SPICAL_NSTEPS; i++) {
+        spi_dly = spical_steps[i];
+        if (spical_pass(dev)) break;
+    }
+    if (i == SPICAL_NSTEPS) {
+        spi_dly = SPICAL_SLOWEST;    // Nothing passed: run slow, keep no record
+        return spi_dly;
+    }
+    if (i > 0 && i < SPICAL_NSTEPS - 1) {
+        i++;                         // The faster step failed: one step of margin
+    }
+
+    spi_dly = spical_steps[i];
+    eeprom_update_byte(ee, spi_dly);
+    eeprom_update_byte(ee + 1, ~spi_dly);
+    return spi_dly;
+}
+
+/*
+    The same search one spical_test() round at a time, for callers under a
+    watchdog: at SPICAL_SLOWEST a whole spical_init() takes several hundred
+    ms. spical_start() once, then spical_step() until it returns 1; the
+    delay found is left in spi_dly. Other SPI traffic in between has to put
+    spi_dly back to cal->dly first.
+*/
+#define SPICAL_STORED   0xff         // cal->i: checking the EEPROM record
+
+typedef struct {
+    uint8_t *ee;
+    uint8_t dev;
+    uint8_t i;                       // spical_steps[] index or SPICAL_STORED
+    uint8_t n;                       // Rounds passed at this step
+    uint8_t dly;
+} spical_t;
+
+static inline void spical_start(spical_t *cal, uint8_t dev, uint8_t *ee)
+{
+    cal->ee = ee;
+    cal->dev = dev;
+    cal->n = 0;
+    cal->dly = eeprom_read_byte(ee);
+    if ((uint8_t) ~cal->dly == eeprom_read_byte(ee + 1)) {
+        cal->i = SPICAL_STORED;
+    } else {
+        cal->i = 0;
+        cal->dly = spical_steps[0];
+    }
+}
+
+static inline uint8_t spical_step(spical_t *cal)
+{
+    uint8_t i;
+
+    spi_dly = cal->dly;
+    if (!spical_test(cal->dev)) {
+        cal->i = (cal->i == SPICAL_STORED) ? 0 : cal->i + 1;
+        if (cal->i == SPICAL_NSTEPS) {
+            spi_dly = SPICAL_SLOWEST;    // Nothing passed: run slow, keep no record
+            return 1;
+        }
+        cal->dly = spical_steps[cal->i];
+        cal->n = 0;
+        return 0;
+    }
+    if (++cal->n < SPICAL_PASSES) return 0;
+
+    i = cal->i;
+    if (i == SPICAL_STORED) return 1;
+    if (i > 0 && i < SPICAL_NSTEPS - 1) {
+        i++;                         // The faster step failed: one step of margin
+    }
+
+    spi_dly = spical_steps[i];
+    eeprom_update_byte(cal->ee, spi_dly);
+    eeprom_update_byte(cal->ee + 1, ~spi_dly);
+    return 1;
+}
+
+#endif